@@ -72,5 +72,13 @@
 #define unlikely(x)	__builtin_expect(!!(x), 0)
 #endif
 
+#ifndef prefetch
+#define prefetch(x)	__builtin_prefetch(x)
+#endif
+
+#ifndef prefetchw
+#define prefetchw(x)	__builtin_prefetch(x, 1)
+#endif
+
 #endif
 
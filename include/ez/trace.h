@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/include/ez/trace.h - optional static tracepoints
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_TRACE_H
+#define __EZ_TRACE_H
+
+/*
+ * Build with -DEZ_USDT to emit Linux USDT probes (provider "ez") which can
+ * be attached by e.g. bpftrace or perf, such as
+ *	bpftrace -e 'usdt:./a.out:ez:lzma_encode_exit { ... }'
+ *
+ * Only <sys/sdt.h> itself is needed: probes are nop instructions plus a
+ * note section, so there is no runtime dependency. Without EZ_USDT (or if
+ * the header is missing) all tracepoints compile away.
+ */
+#if defined(EZ_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EZ_HAVE_USDT
+#endif
+#endif
+
+#ifdef EZ_HAVE_USDT
+#define ez_trace(name, ...)	STAP_PROBEV(ez, name, ##__VA_ARGS__)
+#else
+#define ez_trace(name, ...)	do { } while (0)
+#endif
+
+#endif
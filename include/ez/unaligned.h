@@ -51,5 +51,26 @@ static inline uint32_t get_unaligned_le32(const void *ptr)
 	return get_unaligned32(ptr);
 }
 
+static inline void put_unaligned32(uint32_t v, void *ptr)
+{
+	struct { uint32_t v; } __attribute__((packed)) *unalign = ptr;
+
+	unalign->v = v;
+}
+
+static inline void put_unaligned_le32(uint32_t v, void *ptr)
+{
+	if (!__is_little_endian()) {
+		uint8_t *p = (uint8_t *)ptr;
+
+		p[0] = v;
+		p[1] = v >> 8;
+		p[2] = v >> 16;
+		p[3] = v >> 24;
+		return;
+	}
+	put_unaligned32(v, ptr);
+}
+
 #endif
 
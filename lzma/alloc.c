@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * ez/lzma/alloc.c - allocation of large encoder tables
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "alloc.h"
+
+static inline size_t lzma_hugepage_roundup(size_t size)
+{
+	return DIV_ROUND_UP(size, LZMA_HUGEPAGE_SIZE) * LZMA_HUGEPAGE_SIZE;
+}
+
+static void *lzma_hugepage_alloc(size_t size)
+{
+	uint8_t *ptr, *aligned;
+	size_t tail;
+
+#ifdef MAP_HUGETLB
+	/* explicit huge pages only work if they have been reserved */
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED)
+		return ptr;
+#endif
+	/* fall back to transparent huge pages, which need 2MiB alignment */
+	ptr = mmap(NULL, size + LZMA_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)lzma_hugepage_roundup((uintptr_t)ptr);
+	if (aligned != ptr)
+		munmap(ptr, aligned - ptr);
+	tail = ptr + LZMA_HUGEPAGE_SIZE - aligned;
+	if (tail)
+		munmap(aligned + size, tail);
+#ifdef MADV_HUGEPAGE
+	/* just a hint, regular pages still work if THP is disabled */
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+/* anonymous mappings are always zero-filled, so `zero' is free for them */
+void *lzma_table_alloc(const struct lzma_allocator *allocator,
+		       size_t size, bool zero, bool hugepage)
+{
+	void *ptr;
+
+	if (allocator) {
+		ptr = allocator->alloc(allocator->opaque, size);
+		if (ptr && zero)
+			memset(ptr, 0, size);
+		return ptr;
+	}
+
+	if (hugepage && size >= LZMA_HUGEPAGE_MIN)
+		return lzma_hugepage_alloc(lzma_hugepage_roundup(size));
+	return zero ? calloc(1, size) : malloc(size);
+}
+
+void lzma_table_free(const struct lzma_allocator *allocator,
+		     void *ptr, size_t size, bool hugepage)
+{
+	if (!ptr)
+		return;
+	if (allocator)
+		allocator->free(allocator->opaque, ptr, size);
+	else if (hugepage && size >= LZMA_HUGEPAGE_MIN)
+		munmap(ptr, lzma_hugepage_roundup(size));
+	else
+		free(ptr);
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/alloc.h - allocation of large encoder tables
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __LZMA_ALLOC_H
+#define __LZMA_ALLOC_H
+
+#include <ez/defs.h>
+
+/*
+ * Tables (mf hash/chain, literal probabilities) of at least this size are
+ * backed by 2MiB huge pages if asked, which saves a lot of dTLB misses on
+ * random accesses. It has to be decided by the size only since the same
+ * rule is used again when freeing.
+ */
+#define LZMA_HUGEPAGE_SIZE	(2UL << 20)
+#define LZMA_HUGEPAGE_MIN	(LZMA_HUGEPAGE_SIZE / 2)
+
+/*
+ * Optional user callbacks for encoder allocations, e.g. to use an arena or
+ * a lock-free allocator. `free' gets the same size as `alloc' was asked for,
+ * and the allocator takes precedence over huge pages.
+ */
+struct lzma_allocator {
+	void *(*alloc)(void *opaque, size_t size);
+	void (*free)(void *opaque, void *ptr, size_t size);
+	void *opaque;
+};
+
+void *lzma_table_alloc(const struct lzma_allocator *allocator,
+		       size_t size, bool zero, bool hugepage);
+void lzma_table_free(const struct lzma_allocator *allocator,
+		     void *ptr, size_t size, bool hugepage);
+
+#endif
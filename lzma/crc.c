@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * ez/lzma/crc.c - CRC32 and CRC64 for .xz integrity checks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Both are calculated by slicing-by-8, or by folding 16 bytes at a time with
+ * carry-less multiplication if PCLMULQDQ is available. Note that the SSE4.2
+ * crc32 instruction can't be used here since it's for CRC-32C instead.
+ */
+#include <ez/unaligned.h>
+#include "crc.h"
+#include "bytehash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LZMA_CRC_CLMUL
+#endif
+
+#define CRC64_POLY	0xC96C5795D7870F42ULL
+
+/* crc32_byte_hashtable (for 0xEDB88320) is the first table of the CRC32 one */
+static uint32_t crc32_table[8][256];
+static uint64_t crc64_table[8][256];
+
+#ifdef LZMA_CRC_CLMUL
+static bool crc_clmul;
+#endif
+
+__attribute__((constructor))
+static void lzma_crc_init(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		uint64_t r = i;
+
+		for (j = 0; j < 8; ++j)
+			r = (r >> 1) ^ (CRC64_POLY & -(r & 1));
+		crc32_table[0][i] = crc32_byte_hashtable[i];
+		crc64_table[0][i] = r;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		for (j = 1; j < 8; ++j) {
+			const uint32_t r32 = crc32_table[j - 1][i];
+			const uint64_t r64 = crc64_table[j - 1][i];
+
+			crc32_table[j][i] = crc32_table[0][r32 & 0xFF] ^
+				(r32 >> 8);
+			crc64_table[j][i] = crc64_table[0][r64 & 0xFF] ^
+				(r64 >> 8);
+		}
+	}
+#ifdef LZMA_CRC_CLMUL
+	crc_clmul = __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static uint32_t crc32_slice8(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	for (; size >= 8; size -= 8, buf += 8) {
+		const uint32_t a = get_unaligned_le32(buf) ^ crc;
+		const uint32_t b = get_unaligned_le32(buf + 4);
+
+		crc = crc32_table[7][a & 0xFF] ^
+			crc32_table[6][(a >> 8) & 0xFF] ^
+			crc32_table[5][(a >> 16) & 0xFF] ^
+			crc32_table[4][a >> 24] ^
+			crc32_table[3][b & 0xFF] ^
+			crc32_table[2][(b >> 8) & 0xFF] ^
+			crc32_table[1][(b >> 16) & 0xFF] ^
+			crc32_table[0][b >> 24];
+	}
+
+	while (size--)
+		crc = crc32_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static uint64_t crc64_slice8(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	for (; size >= 8; size -= 8, buf += 8) {
+		const uint32_t a = get_unaligned_le32(buf) ^ (uint32_t)crc;
+		const uint32_t b = get_unaligned_le32(buf + 4) ^
+			(uint32_t)(crc >> 32);
+
+		crc = crc64_table[7][a & 0xFF] ^
+			crc64_table[6][(a >> 8) & 0xFF] ^
+			crc64_table[5][(a >> 16) & 0xFF] ^
+			crc64_table[4][a >> 24] ^
+			crc64_table[3][b & 0xFF] ^
+			crc64_table[2][(b >> 8) & 0xFF] ^
+			crc64_table[1][(b >> 16) & 0xFF] ^
+			crc64_table[0][b >> 24];
+	}
+
+	while (size--)
+		crc = crc64_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef LZMA_CRC_CLMUL
+/*
+ * Fold 16 bytes into the next 16 bytes: (lo * x^(128+n-1) + hi * x^(n-1))
+ * mod P in the bit-reflected domain, n is the CRC width. The remaining
+ * 16 bytes are then reduced by the tables.
+ */
+#define CRC32_FOLD_LO	0x1751997D0ULL
+#define CRC32_FOLD_HI	0x0CCAA009EULL
+#define CRC64_FOLD_LO	0xE05DD497CA393AE4ULL
+#define CRC64_FOLD_HI	0xDABE95AFC7875F40ULL
+
+__attribute__((target("pclmul,sse4.1")))
+static __m128i crc_clmul_fold(const uint8_t *buf, size_t size,
+			      __m128i x, uint64_t lo, uint64_t hi)
+{
+	const __m128i k = _mm_set_epi64x(hi, lo);
+
+	x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)buf));
+	for (buf += 16, size -= 16; size >= 16; buf += 16, size -= 16)
+		x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+						_mm_clmulepi64_si128(x, k, 0x11)),
+				  _mm_loadu_si128((const __m128i *)buf));
+	return x;
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	const size_t folded = size & ~15;
+	uint8_t tmp[16];
+
+	_mm_storeu_si128((__m128i *)tmp,
+			 crc_clmul_fold(buf, folded, _mm_cvtsi32_si128(crc),
+					CRC32_FOLD_LO, CRC32_FOLD_HI));
+	crc = crc32_slice8(tmp, sizeof(tmp), 0);
+	return crc32_slice8(buf + folded, size - folded, crc);
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static uint64_t crc64_clmul(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	const size_t folded = size & ~15;
+	uint8_t tmp[16];
+
+	_mm_storeu_si128((__m128i *)tmp,
+			 crc_clmul_fold(buf, folded, _mm_set_epi64x(0, crc),
+					CRC64_FOLD_LO, CRC64_FOLD_HI));
+	crc = crc64_slice8(tmp, sizeof(tmp), 0);
+	return crc64_slice8(buf + folded, size - folded, crc);
+}
+#endif
+
+/* folding only pays off for a few blocks at least */
+#define LZMA_CRC_CLMUL_MIN	64
+
+uint32_t lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+{
+#ifdef LZMA_CRC_CLMUL
+	if (crc_clmul && size >= LZMA_CRC_CLMUL_MIN)
+		return ~crc32_clmul(buf, size, ~crc);
+#endif
+	return ~crc32_slice8(buf, size, ~crc);
+}
+
+uint64_t lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+#ifdef LZMA_CRC_CLMUL
+	if (crc_clmul && size >= LZMA_CRC_CLMUL_MIN)
+		return ~crc64_clmul(buf, size, ~crc);
+#endif
+	return ~crc64_slice8(buf, size, ~crc);
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/crc.h - CRC32 and CRC64 for .xz integrity checks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __LZMA_CRC_H
+#define __LZMA_CRC_H
+
+#include <ez/defs.h>
+
+/*
+ * Same as lzma_crc32() and lzma_crc64() of liblzma: start with crc = 0,
+ * and pass the previous result to continue with more data.
+ */
+uint32_t lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc);
+uint64_t lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc);
+
+#endif
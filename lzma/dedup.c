@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * ez/lzma/dedup.c - content-hash index of identical input blocks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Identical blocks (e.g. the same file in several layers of an image) are
+ * looked up by a 128-bit hash of their content before encoding, so that the
+ * earlier compressed output can be referred instead of encoding them again.
+ * Hash matches are confirmed by comparing the content, so a collision only
+ * costs a memcmp() and the block is encoded as usual.
+ */
+#include <stdlib.h>
+#include "dedup.h"
+
+struct lzma_dedup_entry {
+	struct lzma_dedup_key key;
+	const uint8_t *in;
+	struct lzma_dedup_ref ref;
+	bool used;
+};
+
+/* the primes of xxHash64, of which the 4-lane round is used here */
+#define DEDUP_PRIME1	0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define DEDUP_PRIME3	0x165667B19E3779F9ULL
+#define DEDUP_PRIME4	0x85EBCA77C2B2AE63ULL
+#define DEDUP_PRIME5	0x27D4EB2F165667C5ULL
+
+/* 4 independent lanes of 32 bytes a stripe, which vectorize well */
+typedef uint64_t dedup_vec_t __attribute__((vector_size(32)));
+
+static inline uint64_t dedup_rotl(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t dedup_round(uint64_t acc, uint64_t in)
+{
+	return dedup_rotl(acc + in * DEDUP_PRIME2, 31) * DEDUP_PRIME1;
+}
+
+static inline uint64_t dedup_get64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t dedup_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= DEDUP_PRIME2;
+	h ^= h >> 29;
+	h *= DEDUP_PRIME3;
+	return h ^ (h >> 32);
+}
+
+/* mix in the trailing (less than 32) bytes */
+static uint64_t dedup_tail(uint64_t h, const uint8_t *p, uint32_t n)
+{
+	for (; n >= 8; p += 8, n -= 8)
+		h = dedup_rotl(h ^ dedup_round(0, dedup_get64(p)), 27) *
+			DEDUP_PRIME1 + DEDUP_PRIME4;
+	for (; n; ++p, --n)
+		h = dedup_rotl(h ^ (*p * DEDUP_PRIME5), 11) * DEDUP_PRIME1;
+	return dedup_avalanche(h);
+}
+
+void lzma_dedup_hash(struct lzma_dedup_key *key,
+		     const uint8_t *in, uint32_t len)
+{
+	dedup_vec_t v = {
+		DEDUP_PRIME1 + DEDUP_PRIME2, DEDUP_PRIME2, 0, -DEDUP_PRIME1
+	};
+	const uint8_t *p = in, *const end = in + len;
+	uint64_t lo, hi;
+	unsigned int i;
+
+	for (; end - p >= 32; p += 32) {
+		dedup_vec_t x;
+
+		memcpy(&x, p, sizeof(x));
+		v += x * DEDUP_PRIME2;
+		v = ((v << 31) | (v >> 33)) * DEDUP_PRIME1;
+	}
+
+	/* two different merges of the lanes make up 128 bits */
+	lo = dedup_rotl(v[0], 1) + dedup_rotl(v[1], 7) +
+		dedup_rotl(v[2], 12) + dedup_rotl(v[3], 18);
+	hi = DEDUP_PRIME5 + len;
+	for (i = 0; i < 4; ++i) {
+		lo = (lo ^ dedup_round(0, v[i])) * DEDUP_PRIME1 + DEDUP_PRIME4;
+		hi = dedup_round(hi, v[3 - i] ^ lo);
+	}
+	lo += len;
+
+	key->lo = dedup_tail(lo, p, end - p);
+	key->hi = dedup_tail(hi, p, end - p);
+	key->len = len;
+}
+
+int lzma_dedup_init(struct lzma_dedup *d, unsigned int bits)
+{
+	if (bits < 4 || bits > 30)
+		return -EINVAL;
+
+	d->table = calloc(1U << bits, sizeof(*d->table));
+	if (!d->table)
+		return -ENOMEM;
+	d->mask = (1U << bits) - 1;
+	memset(&d->stats, 0, sizeof(d->stats));
+	return 0;
+}
+
+void lzma_dedup_exit(struct lzma_dedup *d)
+{
+	free(d->table);
+	d->table = NULL;
+}
+
+static bool dedup_key_equal(const struct lzma_dedup_key *a,
+			    const struct lzma_dedup_key *b)
+{
+	return a->lo == b->lo && a->hi == b->hi && a->len == b->len;
+}
+
+/* linear probing from the low bits of the hash */
+static struct lzma_dedup_entry *dedup_find(struct lzma_dedup_entry *table,
+					   uint32_t mask,
+					   const struct lzma_dedup_key *key)
+{
+	uint32_t i = key->lo & mask;
+
+	while (table[i].used && !dedup_key_equal(&table[i].key, key))
+		i = (i + 1) & mask;
+	return &table[i];
+}
+
+static int dedup_grow(struct lzma_dedup *d)
+{
+	const uint32_t mask = d->mask * 2 + 1;
+	struct lzma_dedup_entry *table;
+	uint32_t i;
+
+	table = calloc((size_t)mask + 1, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i <= d->mask; ++i)
+		if (d->table[i].used)
+			*dedup_find(table, mask, &d->table[i].key) =
+				d->table[i];
+	free(d->table);
+	d->table = table;
+	d->mask = mask;
+	return 0;
+}
+
+int lzma_dedup_lookup(struct lzma_dedup *d, const uint8_t *in, uint32_t len,
+		      struct lzma_dedup_key *key, struct lzma_dedup_ref *ref)
+{
+	const struct lzma_dedup_entry *e;
+
+	lzma_dedup_hash(key, in, len);
+	++d->stats.lookups;
+
+	e = dedup_find(d->table, d->mask, key);
+	if (!e->used)
+		return 0;
+	if (memcmp(e->in, in, len)) {
+		++d->stats.collisions;
+		return 0;
+	}
+
+	*ref = e->ref;
+	++d->stats.hits;
+	d->stats.hit_bytes += len;
+	d->stats.hit_outbytes += ref->size;
+	return 1;
+}
+
+int lzma_dedup_insert(struct lzma_dedup *d, const struct lzma_dedup_key *key,
+		      const uint8_t *in, const struct lzma_dedup_ref *ref)
+{
+	struct lzma_dedup_entry *e;
+
+	/* keep the load factor under 3/4 so that probes stay short */
+	if ((d->stats.entries + 1) * 4ULL > (d->mask + 1ULL) * 3) {
+		int err = dedup_grow(d);
+
+		if (err)
+			return err;
+	}
+
+	e = dedup_find(d->table, d->mask, key);
+	if (!e->used) {
+		++d->stats.entries;
+		e->key = *key;
+		e->used = true;
+	}
+	/* after a collision, the latest block replaces the earlier one */
+	e->in = in;
+	e->ref = *ref;
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/dedup.h - content-hash index of identical input blocks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __LZMA_DEDUP_H
+#define __LZMA_DEDUP_H
+
+#include <ez/defs.h>
+
+/* a 128-bit content hash, see lzma_dedup_hash() */
+struct lzma_dedup_key {
+	uint64_t lo, hi;
+	uint32_t len;
+};
+
+/* where the compressed output of a block is, which is up to the caller */
+struct lzma_dedup_ref {
+	uint64_t offset;
+	uint32_t size;
+};
+
+struct lzma_dedup_stats {
+	/* `collisions' are equal hashes of different content, not hits */
+	uint64_t lookups, hits, collisions;
+	/* input bytes not encoded again, and output bytes referred instead */
+	uint64_t hit_bytes, hit_outbytes;
+	uint32_t entries;
+};
+
+struct lzma_dedup {
+	struct lzma_dedup_entry *table;
+	uint32_t mask;
+	struct lzma_dedup_stats stats;
+};
+
+void lzma_dedup_hash(struct lzma_dedup_key *key,
+		     const uint8_t *in, uint32_t len);
+
+/* `bits' is log2 of the initial table size, which grows when needed */
+int lzma_dedup_init(struct lzma_dedup *d, unsigned int bits);
+void lzma_dedup_exit(struct lzma_dedup *d);
+
+/*
+ * Look up a block of input. Returns 1 with `*ref' of the earlier copy if
+ * found, or 0 and the caller should encode the block and then pass the
+ * same `key' and `in' to lzma_dedup_insert() with where its output is.
+ * The hash isn't cryptographic, so a hit is only returned after the
+ * content is compared with the inserted block, which therefore has to stay
+ * around (unchanged) as long as the index is used.
+ */
+int lzma_dedup_lookup(struct lzma_dedup *d, const uint8_t *in, uint32_t len,
+		      struct lzma_dedup_key *key, struct lzma_dedup_ref *ref);
+int lzma_dedup_insert(struct lzma_dedup *d, const struct lzma_dedup_key *key,
+		      const uint8_t *in, const struct lzma_dedup_ref *ref);
+
+#endif
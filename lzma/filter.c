@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * ez/lzma/filter.c - BCJ and delta filters applied before match finding
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Branch converters (BCJ) turn relative call/branch targets into absolute
+ * ones, so that calls to the same function become repeated byte strings.
+ * The delta filter helps with fixed-stride tables the same way. The output
+ * is the same as the corresponding .xz filters of liblzma.
+ */
+#include <ez/unaligned.h>
+#include "filter.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LZMA_FILTER_SSE2
+#endif
+
+int lzma_filter_init(struct lzma_filter *f, enum lzma_filter_type type,
+		     uint32_t dist)
+{
+	memset(f, 0, sizeof(*f));
+	switch (type) {
+	case LZMA_FILTER_NONE:
+	case LZMA_FILTER_ARM64:
+		break;
+	case LZMA_FILTER_X86:
+		f->x86.prev_pos = (uint32_t)-5;
+		break;
+	case LZMA_FILTER_DELTA:
+		if (dist < 1 || dist > LZMA_DELTA_DIST_MAX)
+			return -EINVAL;
+		f->delta.dist = dist;
+		break;
+	default:
+		return -EINVAL;
+	}
+	f->type = type;
+	return 0;
+}
+
+/* out[i] = in[i] - in[i - dist], with the previous bytes from history */
+static size_t delta_encode(struct lzma_filter *f, uint8_t *out,
+			   const uint8_t *in, size_t size)
+{
+	const uint32_t dist = f->delta.dist;
+	uint8_t *const history = f->delta.history;
+	uint8_t newhist[LZMA_DELTA_DIST_MAX];
+	const size_t head = min_t(size_t, size, dist);
+	size_t i;
+
+	/* save the input tail first since `out' may overwrite it */
+	if (size >= dist) {
+		memcpy(newhist, in + size - dist, dist);
+	} else {
+		memcpy(newhist, history + size, dist - size);
+		memcpy(newhist + dist - size, in, size);
+	}
+
+	if (out != in) {
+		/* independent bytes, which is vectorized by compilers */
+		for (i = dist; i < size; ++i)
+			out[i] = in[i] - in[i - dist];
+	} else {
+		for (i = size; i > dist; --i)
+			out[i - 1] -= out[i - 1 - dist];
+	}
+	for (i = 0; i < head; ++i)
+		out[i] = in[i] - history[i];
+
+	memcpy(history, newhist, dist);
+	return size;
+}
+
+#define x86_test_msbyte(b)	((((b) + 1) & 0xFE) == 0)
+
+/* skip bytes which are neither E8 (call) nor E9 (jmp) */
+static size_t x86_next_opcode(const uint8_t *buf, size_t i, size_t limit)
+{
+#ifdef LZMA_FILTER_SSE2
+	const __m128i fe = _mm_set1_epi8(0xFE), e8 = _mm_set1_epi8(0xE8);
+
+	while (i + 16 <= limit) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		const unsigned int mask = _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_and_si128(v, fe), e8));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+#endif
+	while (i < limit && (buf[i] & 0xFE) != 0xE8)
+		++i;
+	return i;
+}
+
+/* the same as x86_code() of liblzma */
+static size_t x86_encode(struct lzma_filter *f, uint8_t *buf, size_t size)
+{
+	static const uint32_t mask_to_bit_number[5] = { 0, 1, 2, 2, 3 };
+	const uint32_t now_pos = f->pos;
+	uint32_t prev_mask = f->x86.prev_mask;
+	uint32_t prev_pos = f->x86.prev_pos;
+	size_t i, limit;
+
+	if (size < 5)
+		return 0;
+
+	if (now_pos - prev_pos > 5)
+		prev_pos = now_pos - 5;
+
+	limit = size - 4;
+	for (i = 0; (i = x86_next_opcode(buf, i, limit)) < limit; ) {
+		const uint32_t offset = now_pos + (uint32_t)i - prev_pos;
+		uint8_t b;
+
+		prev_pos = now_pos + (uint32_t)i;
+		if (offset > 5) {
+			prev_mask = 0;
+		} else {
+			uint32_t j;
+
+			for (j = 0; j < offset; ++j) {
+				prev_mask &= 0x77;
+				prev_mask <<= 1;
+			}
+		}
+
+		b = buf[i + 4];
+		if (x86_test_msbyte(b) && (prev_mask >> 1) <= 4 &&
+		    (prev_mask >> 1) != 3) {
+			uint32_t src = get_unaligned_le32(buf + i + 1), dest;
+
+			while (1) {
+				uint32_t n;
+
+				dest = src + (now_pos + (uint32_t)i + 5);
+				if (!prev_mask)
+					break;
+
+				n = mask_to_bit_number[prev_mask >> 1];
+				b = dest >> (24 - n * 8);
+				if (!x86_test_msbyte(b))
+					break;
+				src = dest ^ ((1U << (32 - n * 8)) - 1);
+			}
+			dest &= 0x01FFFFFF;
+			dest |= 0U - (dest & 0x01000000);
+			put_unaligned_le32(dest, buf + i + 1);
+			i += 5;
+			prev_mask = 0;
+		} else {
+			++i;
+			prev_mask |= 1;
+			if (x86_test_msbyte(b))
+				prev_mask |= 0x10;
+		}
+	}
+	f->x86.prev_mask = prev_mask;
+	f->x86.prev_pos = prev_pos;
+	return i;
+}
+
+/* BL or ADRP */
+static bool arm64_is_branch(uint32_t insn)
+{
+	return (insn >> 26) == 0x25 || (insn & 0x9F000000) == 0x90000000;
+}
+
+/* skip words which are neither BL nor ADRP */
+static size_t arm64_next_branch(const uint8_t *buf, size_t i, size_t size)
+{
+#ifdef LZMA_FILTER_SSE2
+	const __m128i blmask = _mm_set1_epi32(0xFC000000);
+	const __m128i bl = _mm_set1_epi32(0x94000000);
+	const __m128i adrpmask = _mm_set1_epi32(0x9F000000);
+	const __m128i adrp = _mm_set1_epi32(0x90000000);
+
+	while (i + 16 <= size) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		const __m128i hit = _mm_or_si128(
+			_mm_cmpeq_epi32(_mm_and_si128(v, blmask), bl),
+			_mm_cmpeq_epi32(_mm_and_si128(v, adrpmask), adrp));
+		const unsigned int mask = _mm_movemask_epi8(hit);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+#endif
+	while (i + 4 <= size && !arm64_is_branch(get_unaligned_le32(buf + i)))
+		i += 4;
+	return i;
+}
+
+/* the same as arm64_code() of liblzma */
+static size_t arm64_encode(struct lzma_filter *f, uint8_t *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; (i = arm64_next_branch(buf, i, size)) + 4 <= size;
+	     i += 4) {
+		uint32_t insn = get_unaligned_le32(buf + i);
+		uint32_t pc = f->pos + (uint32_t)i;
+
+		if ((insn >> 26) == 0x25) {
+			insn = 0x94000000 | ((insn + (pc >> 2)) & 0x03FFFFFF);
+		} else {
+			uint32_t dest = ((insn >> 29) & 3) |
+				((insn >> 3) & 0x001FFFFC);
+
+			if ((dest + 0x00020000) & 0x001C0000)
+				continue;
+			dest += pc >> 12;
+			insn &= 0x9000001F;
+			insn |= (dest & 3) << 29;
+			insn |= (dest & 0x0003FFFC) << 3;
+			insn |= (0U - (dest & 0x00020000)) & 0x00E00000;
+		}
+		put_unaligned_le32(insn, buf + i);
+	}
+	return i;
+}
+
+size_t lzma_filter_encode(struct lzma_filter *f, uint8_t *out,
+			  const uint8_t *in, size_t size, bool last)
+{
+	size_t done;
+
+	if (f->type == LZMA_FILTER_DELTA) {
+		done = delta_encode(f, out, in, size);
+	} else {
+		if (out != in)
+			memcpy(out, in, size);
+
+		if (f->type == LZMA_FILTER_X86)
+			done = x86_encode(f, out, size);
+		else if (f->type == LZMA_FILTER_ARM64)
+			done = arm64_encode(f, out, size);
+		else
+			done = size;
+	}
+
+	/* the trailing bytes of the stream are left as they are */
+	if (last)
+		done = size;
+	f->pos += done;
+	return done;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/filter.h - BCJ and delta filters applied before match finding
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __LZMA_FILTER_H
+#define __LZMA_FILTER_H
+
+#include <ez/defs.h>
+
+/* values are the .xz filter IDs except for LZMA_FILTER_NONE */
+enum lzma_filter_type {
+	LZMA_FILTER_NONE	= 0,
+	LZMA_FILTER_DELTA	= 0x03,
+	LZMA_FILTER_X86		= 0x04,
+	LZMA_FILTER_ARM64	= 0x0A,
+};
+
+#define LZMA_DELTA_DIST_MAX	256
+
+struct lzma_filter {
+	enum lzma_filter_type type;
+	/* uncompressed position of the next byte to be filtered */
+	uint32_t pos;
+
+	union {
+		struct {
+			uint32_t prev_mask, prev_pos;
+		} x86;
+		struct {
+			uint32_t dist;
+			/* the last `dist' input bytes, oldest first */
+			uint8_t history[LZMA_DELTA_DIST_MAX];
+		} delta;
+	};
+};
+
+/*
+ * `dist' is the distance of the delta filter (1 ~ 256), ignored otherwise.
+ * Filters restart from position 0, as .xz decoders do for each block.
+ */
+int lzma_filter_init(struct lzma_filter *f, enum lzma_filter_type type,
+		     uint32_t dist);
+
+/*
+ * Filter `size' bytes of `in' to `out' (which can be the same buffer), and
+ * return how many bytes are final. Branch converters can't decide on the
+ * last few bytes without what follows, so these are copied unconverted and
+ * have to be passed again at the beginning of the next call unless `last'.
+ * The result is the same however the input is split.
+ */
+size_t lzma_filter_encode(struct lzma_filter *f, uint8_t *out,
+			  const uint8_t *in, size_t size, bool last);
+
+#endif
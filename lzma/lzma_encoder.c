@@ -8,11 +8,19 @@
  *          Lasse Collin <lasse.collin@tukaani.org>
  *          Gao Xiang <hsiangkao@aol.com>
  */
+#include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <ez/bitops.h>
+#include <ez/trace.h>
 #include "rc_encoder_ckpt.h"
 #include "lzma_common.h"
 #include "mf.h"
+#include "crc.h"
+#include "filter.h"
+#include "dedup.h"
 
 #define kNumBitModelTotalBits	11
 #define kBitModelTotal		(1 << kNumBitModelTotalBits)
@@ -35,6 +43,9 @@
 
 #define kNumLenToPosStates	4
 
+/* literal coders of 0x300 probabilities each, lc + lp <= 12 */
+#define LZMA_LIT_CTX_MAX	(1 << 12)
+
 #define is_literal_state(state) ((state) < 7)
 
 /* note that here dist is an zero-based distance */
@@ -45,26 +56,96 @@ static unsigned int get_pos_slot2(unsigned int dist)
 	return (zz + zz) + ((dist >> (zz - 1)) & 1);
 }
 
-static unsigned int get_pos_slot(unsigned int dist)
+/*
+ * Position slots of small distances are looked up directly (aka. g_FastPos
+ * in LZMA SDK). Since the slot of (dist >> n) is exactly 2n less than the
+ * one of dist as long as dist >> n >= 2, larger distances use the same
+ * table after shifting.
+ */
+#define kNumFastPosBits		13
+#define kFastPosShift		(kNumFastPosBits - 1)
+
+static uint8_t lzma_fastpos[1 << kNumFastPosBits];
+
+__attribute__((constructor))
+static void lzma_fastpos_init(void)
+{
+	unsigned int dist;
+
+	for (dist = 0; dist < ARRAY_SIZE(lzma_fastpos); ++dist)
+		lzma_fastpos[dist] = dist <= 4 ? dist : get_pos_slot2(dist);
+}
+
+static inline unsigned int get_pos_slot(unsigned int dist)
 {
-	return dist <= 4 ? dist : get_pos_slot2(dist);
+	if (dist < (1U << kNumFastPosBits))
+		return lzma_fastpos[dist];
+	if (dist < (1U << (kNumFastPosBits + kFastPosShift)))
+		return lzma_fastpos[dist >> kFastPosShift] + 2 * kFastPosShift;
+	return lzma_fastpos[dist >> (2 * kFastPosShift)] + 4 * kFastPosShift;
 }
 
 /* aka. GetLenToPosState in LZMA */
 static inline unsigned int get_len_state(unsigned int len)
 {
-	if (len < kNumLenToPosStates - 1 + kMatchMinLen)
-		return len - kMatchMinLen;
-
-	return kNumLenToPosStates - 1;
+	return min(len - kMatchMinLen, kNumLenToPosStates - 1U);
 }
 
+/* state transitions after each kind of symbols, shared by all parsers */
+static const uint8_t kLiteralNextStates[kNumStates] = {
+	0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 4, 5
+};
+static const uint8_t kMatchNextStates[kNumStates] = {
+	7, 7, 7, 7, 7, 7, 7, 10, 10, 10, 10, 10
+};
+static const uint8_t kRepNextStates[kNumStates] = {
+	8, 8, 8, 8, 8, 8, 8, 11, 11, 11, 11, 11
+};
+static const uint8_t kShortRepNextStates[kNumStates] = {
+	9, 9, 9, 9, 9, 9, 9, 11, 11, 11, 11, 11
+};
+
+/* can be ORed with a level to spend much more time for a bit better ratio */
+#define LZMA_PRESET_EXTREME	(1 << 8)
+
+enum lzma_parser {
+	LZMA_PARSER_FAST,	/* lzma_get_optimum_fast() with lookahead */
+	LZMA_PARSER_GREEDY,	/* take the longest match at once */
+};
+
 struct lzma_properties {
 	uint32_t lc;	/* 0 <= lc <= 8, default = 3 */
 	uint32_t lp;	/* 0 <= lp <= 4, default = 0 */
 	uint32_t pb;	/* 0 <= pb <= 4, default = 2 */
 
+	enum lzma_parser parser;
 	struct lzma_mf_properties mf;
+
+	/* throughput to keep in MB/s by adapting mf settings, 0 to disable */
+	uint32_t target_speed;
+
+	/*
+	 * LZMA2 chunks expected to save less than this percentage are stored
+	 * raw without encoding (see lzma_should_store_raw()), 0 to disable
+	 */
+	uint32_t raw_threshold;
+
+	/* BCJ or delta filter before LZMA2 in .xz blocks, see filter.h */
+	enum lzma_filter_type filter;
+	uint32_t delta_dist;
+
+	/*
+	 * match finder workers within each .xz block, 0 to search inline.
+	 * It's an upper bound: blocks are still searched inline if workers
+	 * can't win, see lzma_mf_mt_threads().
+	 */
+	unsigned int mf_threads;
+
+	/* only reset literal coders used since the last reset, for tiny inputs */
+	bool sparse_reset;
+
+	/* encode identical items of lzma_encode_batch() only once */
+	bool dedup;
 };
 
 struct lzma_length_encoder {
@@ -77,15 +158,44 @@ struct lzma_encoder_destsize {
 
 	uint8_t *op;
 	uint32_t capacity;
+	/* input position which the output (with `ending') covers so far */
+	uint32_t inpos;
 
 	uint32_t esz;
 	uint8_t ending[LZMA_REQUIRED_INPUT_MAX + 5];
 };
 
-struct lzma_encoder {
-	struct lzma_mf mf;
-	struct lzma_rc_encoder rc;
+/* the amount of input between two throughput checks */
+#define LZMA_RATECTL_INTERVAL	(16 * 1024)
 
+/*
+ * Rate control: depth and nice_len of the matchfinder are lowered if the
+ * encoder runs slower than the target throughput and raised back (up to
+ * the configured values) if it runs fast enough. Both only affect how
+ * hard the encoder searches, so it's safe to change them at any time.
+ * The state and the adapted settings are kept by lzma_encoder_reset() as
+ * long as the properties stay the same, so that units smaller than
+ * LZMA_RATECTL_INTERVAL (blocks, batch items, clusters) are adapted too.
+ */
+struct lzma_ratectl {
+	uint64_t target;	/* in bytes per second, 0 if disabled */
+
+	/* time spent and input consumed since the last adjustment */
+	uint64_t ns;
+	uint32_t bytes;
+
+	uint32_t max_nice_len;
+	uint8_t max_depth;
+};
+
+/*
+ * Fields are grouped by how often they are accessed: per-symbol state comes
+ * first, then all non-literal models in one block starting at a cache line,
+ * then fields only used once in a while (setup, destsize, rate control).
+ * The large matchfinder and range coder are kept at the end. This is meant
+ * for locality; perf.sh counts L1 misses to check it on machines with a PMU.
+ */
+struct lzma_encoder {
 	uint8_t *op, *oend;
 	bool finish;
 	bool need_eopm;
@@ -96,36 +206,133 @@ struct lzma_encoder {
 	uint32_t reps[LZMA_NUM_REPS];
 
 	unsigned int pbMask, lpMask;
-
 	unsigned int lc, lp;
 
-	/* the following names came from lzma-specification.txt */
-	probability isMatch[kNumStates][LZMA_NUM_PB_STATES_MAX];
-	probability isRep[kNumStates];
-	probability isRepG0[kNumStates];
-	probability isRepG1[kNumStates];
-	probability isRepG2[kNumStates];
-	probability isRep0Long[kNumStates][LZMA_NUM_PB_STATES_MAX];
-
-	probability posSlotEncoder[kNumLenToPosStates][1 << kNumPosSlotBits];
-	probability posEncoders[kNumFullDistances];
-	probability posAlignEncoder[1 << kNumAlignBits];
-
 	probability *literal;
 
-	struct lzma_length_encoder lenEnc;
-	struct lzma_length_encoder repLenEnc;
-
 	struct {
-		struct lzma_match matches[kMatchMaxLen];
+		struct lzma_match *matches;
 		unsigned int matches_count;
 	} fast;
 
+	/*
+	 * All probabilities but literal ones form one contiguous block (there
+	 * is no padding between arrays of `probability'), which is reset at
+	 * once by lzma_probs_init(). The following names came from
+	 * lzma-specification.txt.
+	 */
+	struct {
+		probability isMatch[kNumStates][LZMA_NUM_PB_STATES_MAX];
+		probability isRep[kNumStates];
+		probability isRepG0[kNumStates];
+		probability isRepG1[kNumStates];
+		probability isRepG2[kNumStates];
+		probability isRep0Long[kNumStates][LZMA_NUM_PB_STATES_MAX];
+
+		probability posSlotEncoder[kNumLenToPosStates]
+					  [1 << kNumPosSlotBits];
+
+		struct lzma_length_encoder lenEnc;
+		struct lzma_length_encoder repLenEnc;
+
+		probability posEncoders[kNumFullDistances];
+		probability posAlignEncoder[1 << kNumAlignBits];
+	} __attribute__((aligned(64)));
+
+	/* cold fields */
+	enum lzma_parser parser;
+	/* only reset literal coders in `littouched', see lzma_literal_reset() */
+	bool sparse_reset;
+	uint64_t littouched[LZMA_LIT_CTX_MAX / 64];
+	/* the capacity of fast.matches */
+	unsigned int matches_size;
+	/* how `literal' and `fast.matches' were allocated */
+	bool hugepage;
+	const struct lzma_allocator *allocator;
+
 	struct lzma_encoder_destsize *dstsize;
+	struct lzma_ratectl ratectl;
+
+	struct lzma_rc_encoder rc;
+	struct lzma_mf mf;
 };
 
+/* the number of probabilities in the block from isMatch to posAlignEncoder */
+#define LZMA_NUM_MODEL_PROBS						\
+	((offsetof(struct lzma_encoder, posAlignEncoder) -		\
+	  offsetof(struct lzma_encoder, isMatch)) / sizeof(probability) +	\
+	 (1 << kNumAlignBits))
+
 #define change_pair(smalldist, bigdist) (((bigdist) >> 7) > (smalldist))
 
+/* emit long byte runs as distance-1 matches directly */
+static bool lzma_get_run(struct lzma_encoder *lzma,
+			 uint32_t *back_res, uint32_t *len_res)
+{
+	const uint32_t len = lzma_mf_find_run(&lzma->mf);
+	unsigned int i;
+
+	if (!len)
+		return false;
+
+	for (i = 0; i < LZMA_NUM_REPS; ++i)
+		if (lzma->reps[i] == 1)
+			break;
+	*back_res = i < LZMA_NUM_REPS ? i : LZMA_NUM_REPS;
+	*len_res = len;
+	return true;
+}
+
+static int lzma_get_optimum_greedy(struct lzma_encoder *lzma,
+				   uint32_t *back_res, uint32_t *len_res)
+{
+	struct lzma_mf *const mf = &lzma->mf;
+	const struct lzma_match *longest;
+	const uint8_t *ip, *ilimit;
+	uint32_t replen;
+	int ret;
+
+	DBG_BUGON(mf->lookahead);
+	if (lzma_get_run(lzma, back_res, len_res))
+		return 0;
+
+	ret = lzma_mf_find(mf, lzma->fast.matches, lzma->finish);
+	if (ret < 0)
+		return ret;
+
+	ip = mf->buffer + mf->cur - mf->lookahead;
+	if (mf->iend - ip <= 2)
+		goto out_literal;
+
+	ilimit = (mf->iend <= ip + kMatchMaxLen ?
+		  mf->iend : ip + kMatchMaxLen);
+
+	/* only rep0 is checked, which is the most common one */
+	replen = 0;
+	if (ip - mf->buffer >= lzma->reps[0] &&
+	    get_unaligned16(ip) == get_unaligned16(ip - lzma->reps[0]))
+		replen = ez_memcmp(ip + 2, ip - lzma->reps[0] + 2,
+				   ilimit) - ip;
+
+	longest = ret ? &lzma->fast.matches[ret - 1] : NULL;
+	if (replen && (!longest || replen + 1 >= longest->len)) {
+		*back_res = 0;
+		*len_res = replen;
+	} else if (longest &&
+		   (longest->len >= 3 || longest->dist <= 0x80)) {
+		*back_res = LZMA_NUM_REPS + longest->dist - 1;
+		*len_res = longest->len;
+	} else {
+		goto out_literal;
+	}
+	lzma_mf_skip(mf, *len_res - 1);
+	return 0;
+
+out_literal:
+	*len_res = 0;
+	return 1;
+}
+
 static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 				 uint32_t *back_res, uint32_t *len_res)
 {
@@ -140,6 +347,9 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 	int ret;
 
 	if (!mf->lookahead) {
+		if (lzma_get_run(lzma, back_res, len_res))
+			return 0;
+
 		ret = lzma_mf_find(mf, lzma->fast.matches, lzma->finish);
 
 		if (ret < 0)
@@ -330,15 +540,18 @@ static void literal_matched(struct lzma_rc_encoder *rc, probability *probs,
 
 static void literal(struct lzma_encoder *lzma, uint32_t position)
 {
-	static const unsigned char kLiteralNextStates[] = {
-		0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 4, 5
-	};
 	struct lzma_mf *mf = &lzma->mf;
 	const uint8_t *ptr = &mf->buffer[mf->cur - mf->lookahead];
 	const unsigned int state = lzma->state;
 
-	probability *probs = lzma->literal +
-		3 * ((((position << 8) + ptr[-1]) & lzma->lpMask) << lzma->lc);
+	/* the byte before the input is regarded as 0 */
+	const uint8_t prev_byte = ptr != mf->buffer ? ptr[-1] : 0;
+	const unsigned int ctx =
+		(((position << 8) + prev_byte) & lzma->lpMask) << lzma->lc;
+	probability *probs = lzma->literal + 3 * ctx;
+
+	/* `ctx' is a multiple of 0x100, one for each literal coder */
+	lzma->littouched[ctx >> 14] |= 1ULL << ((ctx >> 8) & 63);
 
 	if (is_literal_state(state)) {
 		/*
@@ -391,7 +604,7 @@ static void match(struct lzma_encoder *lzma, const uint32_t pos_state,
 	const uint32_t posSlot = get_pos_slot(dist);
 	const uint32_t lenState = get_len_state(len);
 
-	lzma->state = (is_literal_state(lzma->state) ? 7 : 10);
+	lzma->state = kMatchNextStates[lzma->state];
 	length(&lzma->rc, &lzma->lenEnc, pos_state, len);
 
 	/* - unsigned posSlot = PosSlotDecoder[lenState].Decode(&RangeDec); */
@@ -455,10 +668,10 @@ static void rep_match(struct lzma_encoder *lzma, const uint32_t pos_state,
 	}
 
 	if (len == 1) {
-		lzma->state = is_literal_state(state) ? 9 : 11;
+		lzma->state = kShortRepNextStates[state];
 	} else {
 		length(&lzma->rc, &lzma->repLenEnc, pos_state, len);
-		lzma->state = is_literal_state(state) ? 8 : 11;
+		lzma->state = kRepNextStates[state];
 	}
 }
 
@@ -569,6 +782,8 @@ out:
 	return 0;
 
 err_enospc:
+	ez_trace(lzma_destsize_rollback, symbols_size,
+		 lzma->dstsize->capacity);
 	rc_restore_checkpoint(&lzma->rc, &lzma->dstsize->cp);
 	lzma->op = lzma->dstsize->op;
 	lzma->dstsize->capacity = 0;
@@ -628,6 +843,8 @@ static int encode_symbol(struct lzma_encoder *lzma, uint32_t back,
 
 		/* len bytes has been consumed by encoder */
 		DBG_BUGON(mf->lookahead < len);
+		if (lzma->dstsize)
+			lzma->dstsize->inpos = *position;
 		mf->lookahead -= len;
 		*position += len;
 	}
@@ -650,16 +867,79 @@ static int encode_sequence(struct lzma_encoder *lzma, unsigned int nliterals,
 	return encode_symbol(lzma, back, len, position);
 }
 
+static uint64_t lzma_ratectl_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account the work done since `*since', and adapt the settings if needed */
+static void lzma_ratectl_update(struct lzma_encoder *lzma,
+				uint32_t bytes, uint64_t *since)
+{
+	struct lzma_ratectl *const rc = &lzma->ratectl;
+	struct lzma_mf *const mf = &lzma->mf;
+	const uint64_t now = lzma_ratectl_clock();
+	uint64_t expected;
+
+	rc->ns += now - *since;
+	rc->bytes += bytes;
+	*since = now;
+
+	if (rc->bytes < LZMA_RATECTL_INTERVAL)
+		return;
+
+	/* the time which the input should take at the target speed */
+	expected = rc->bytes * 1000000000ULL / rc->target;
+
+	if (rc->ns > expected) {
+		/* too slow, search less (shorter chains first) */
+		if (mf->depth > 1)
+			mf->depth -= (mf->depth + 3) / 4;
+		else if (mf->nice_len > 8)
+			mf->nice_len -= mf->nice_len / 4;
+	} else if (rc->ns < expected - expected / 4) {
+		/* fast enough with some margin, search more */
+		if (mf->nice_len < rc->max_nice_len)
+			mf->nice_len = min_t(uint32_t, rc->max_nice_len,
+					     mf->nice_len + mf->nice_len / 4 + 1);
+		else if (mf->depth < rc->max_depth)
+			mf->depth = min_t(uint32_t, rc->max_depth,
+					  mf->depth + mf->depth / 4 + 1);
+	}
+	ez_trace(lzma_ratectl, rc->bytes, rc->ns, mf->depth, mf->nice_len);
+	rc->ns = 0;
+	rc->bytes = 0;
+}
+
 static int __lzma_encode(struct lzma_encoder *lzma)
 {
 	uint32_t pos32 = lzma->mf.cur - lzma->mf.lookahead;
+	uint8_t *const op __maybe_unused = lzma->op;
+	uint32_t ratepos = pos32;
+	uint64_t ratetime = 0;
 	int err;
 
+	ez_trace(lzma_encode_entry, pos32, lzma->mf.iend - lzma->mf.buffer);
+	if (lzma->ratectl.target)
+		ratetime = lzma_ratectl_clock();
+
 	do {
 		uint32_t back, len;
 		int nlits;
 
-		nlits = lzma_get_optimum_fast(lzma, &back, &len);
+		if (lzma->ratectl.target &&
+		    pos32 - ratepos >= LZMA_RATECTL_INTERVAL) {
+			lzma_ratectl_update(lzma, pos32 - ratepos, &ratetime);
+			ratepos = pos32;
+		}
+
+		if (lzma->parser == LZMA_PARSER_GREEDY)
+			nlits = lzma_get_optimum_greedy(lzma, &back, &len);
+		else
+			nlits = lzma_get_optimum_fast(lzma, &back, &len);
 
 		if (nlits < 0) {
 			err = nlits;
@@ -668,26 +948,62 @@ static int __lzma_encode(struct lzma_encoder *lzma)
 
 		err = encode_sequence(lzma, nlits, back, len, &pos32);
 	} while (!err);
+
+	if (lzma->ratectl.target)
+		lzma_ratectl_update(lzma, pos32 - ratepos, &ratetime);
+	ez_trace(lzma_encode_exit, err, pos32, lzma->op - op);
 	return err;
 }
 
-static void lzma_length_encoder_reset(struct lzma_length_encoder *lc)
-{
-	unsigned int i;
+/* all probabilities start from the same value, so one vector is stored */
+typedef probability lzma_prob_vec_t __attribute__((vector_size(32)));
 
-	for (i = 0; i < ARRAY_SIZE(lc->low); i++)
-		lc->low[i] = kProbInitValue;
+static void lzma_probs_init(probability *p, size_t n)
+{
+	const lzma_prob_vec_t v = (lzma_prob_vec_t){0} + kProbInitValue;
+	const unsigned int step = sizeof(v) / sizeof(*p);
 
-	for (i = 0; i < ARRAY_SIZE(lc->high); i++)
-		lc->high[i] = kProbInitValue;
+	for (; n >= step; p += step, n -= step)
+		memcpy(p, &v, sizeof(v));
+	for (; n; --n)
+		*p++ = kProbInitValue;
 }
 
-static int lzma_encoder_reset(struct lzma_encoder *lzma,
-			      const struct lzma_properties *props)
+/*
+ * Small inputs only touch a few of (up to 4096) literal coders, so it's
+ * much cheaper to reset just those if `sparse_reset' is set.
+ */
+static void lzma_literal_reset(struct lzma_encoder *lzma)
 {
-	unsigned int i, j, oldlclp, lclp;
+	const unsigned int nctx = 1U << (lzma->lc + lzma->lp);
+	const unsigned int nwords = DIV_ROUND_UP(nctx, 64);
+	unsigned int i;
+
+	if (!lzma->sparse_reset) {
+		lzma_probs_init(lzma->literal, 0x300 * nctx);
+	} else {
+		for (i = 0; i < nwords; ++i) {
+			uint64_t bits = lzma->littouched[i];
+
+			/* all bits are set for a newly allocated `literal' */
+			if (nctx < 64)
+				bits &= (1ULL << nctx) - 1;
+			while (bits) {
+				const unsigned int ctx = i * 64 +
+					__builtin_ctzll(bits);
+
+				lzma_probs_init(lzma->literal + 0x300 * ctx,
+						0x300);
+				bits &= bits - 1;
+			}
+		}
+	}
+	memset(lzma->littouched, 0, nwords * sizeof(lzma->littouched[0]));
+}
 
-	lzma_mf_reset(&lzma->mf, &props->mf);
+/* reset the coder state and all probabilities, but keep the dictionary */
+static void lzma_encoder_reset_state(struct lzma_encoder *lzma)
+{
 	rc_reset(&lzma->rc);
 
 	/* refer to "The main loop of decoder" of lzma specification */
@@ -696,139 +1012,1646 @@ static int lzma_encoder_reset(struct lzma_encoder *lzma,
 		lzma->reps[3] = 1;
 
 	/* reset all LZMA probability matrices */
-	for (i = 0; i < kNumStates; ++i) {
-		for (j = 0; j < LZMA_NUM_PB_STATES_MAX; ++j) {
-			lzma->isMatch[i][j] = kProbInitValue;
-			lzma->isRep0Long[i][j] = kProbInitValue;
-		}
-		lzma->isRep[i] = kProbInitValue;
-		lzma->isRepG0[i] = kProbInitValue;
-		lzma->isRepG1[i] = kProbInitValue;
-		lzma->isRepG2[i] = kProbInitValue;
+	lzma_probs_init(&lzma->isMatch[0][0], LZMA_NUM_MODEL_PROBS);
+	lzma_literal_reset(lzma);
+}
+
+static int lzma_encoder_reset(struct lzma_encoder *lzma,
+			      const struct lzma_properties *props)
+{
+	const bool keep_ratectl = props->target_speed &&
+		lzma->ratectl.target == props->target_speed * 1000000ULL &&
+		lzma->ratectl.max_nice_len == props->mf.nice_len &&
+		lzma->ratectl.max_depth == props->mf.depth;
+	const uint32_t nice_len = lzma->mf.nice_len, depth = lzma->mf.depth;
+	unsigned int oldlclp, lclp, matches_size;
+	int err;
+
+	ez_trace(lzma_encoder_reset, props->lc, props->lp, props->pb,
+		 props->mf.dictsize);
+	/* the destsize mode is set up for each call by its caller */
+	lzma->dstsize = NULL;
+	err = lzma_mf_reset(&lzma->mf, &props->mf);
+	if (err)
+		return err;
+	/* go on with the settings adapted so far, see struct lzma_ratectl */
+	if (keep_ratectl) {
+		lzma->mf.nice_len = nice_len;
+		lzma->mf.depth = depth;
 	}
 
-	for (i = 0; i < kNumLenToPosStates; ++i)
-		for (j = 0; j < (1 << kNumPosSlotBits); j++)
-			lzma->posSlotEncoder[i][j] = kProbInitValue;
+	/*
+	 * `allocator' covers both tables, so free them all before switching
+	 * to another one. Otherwise a failure in between would leave tables
+	 * of two allocators behind.
+	 */
+	if (lzma->allocator != props->mf.allocator) {
+		lzma_table_free(lzma->allocator, lzma->fast.matches,
+				lzma->matches_size * sizeof(struct lzma_match),
+				false);
+		lzma->fast.matches = NULL;
+		lzma_table_free(lzma->allocator, lzma->literal,
+				(0x300 << (lzma->lc + lzma->lp)) *
+				sizeof(probability), lzma->hugepage);
+		lzma->literal = NULL;
+		lzma->allocator = props->mf.allocator;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(lzma->posEncoders); i++)
-		lzma->posEncoders[i] = kProbInitValue;
+	/*
+	 * matchfinders report strictly longer matches only: at most one for
+	 * each candidate in the chain plus the 2- and 3-byte ones.
+	 */
+	matches_size = min_t(unsigned int, props->mf.depth + 2, kMatchMaxLen);
+	if (lzma->fast.matches && matches_size > lzma->matches_size) {
+		lzma_table_free(lzma->allocator, lzma->fast.matches,
+				lzma->matches_size * sizeof(struct lzma_match),
+				false);
+		lzma->fast.matches = NULL;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(lzma->posAlignEncoder); i++)
-		lzma->posAlignEncoder[i] = kProbInitValue;
+	if (!lzma->fast.matches) {
+		lzma->fast.matches = lzma_table_alloc(props->mf.allocator,
+				matches_size * sizeof(struct lzma_match),
+				false, false);
+		if (!lzma->fast.matches)
+			return -ENOMEM;
+		lzma->matches_size = matches_size;
+	}
+	lzma->fast.matches_count = 0;
 
 	/* set up LZMA literal probabilities */
 	oldlclp = lzma->lc + lzma->lp;
 	lclp = props->lc + props->lp;
 	lzma->lc = props->lc;
 	lzma->lp = props->lp;
-
-	if (lzma->literal && lclp != oldlclp) {
-		free(lzma->literal);
+	lzma->parser = props->parser;
+	lzma->sparse_reset = props->sparse_reset;
+
+	if (lzma->literal && (lclp != oldlclp ||
+			      lzma->hugepage != props->mf.hugepage)) {
+		lzma_table_free(lzma->allocator, lzma->literal,
+				(0x300 << oldlclp) * sizeof(probability),
+				lzma->hugepage);
 		lzma->literal = NULL;
 	}
 
 	if (!lzma->literal) {
-		lzma->literal = malloc((0x300 << lclp) * sizeof(probability));
+		lzma->literal = lzma_table_alloc(props->mf.allocator,
+						 (0x300 << lclp) *
+						 sizeof(probability),
+						 false, props->mf.hugepage);
 		if (!lzma->literal)
 			return -ENOMEM;
+		/* nothing is initialized yet */
+		memset(lzma->littouched, 0xff, sizeof(lzma->littouched));
+		lzma->hugepage = props->mf.hugepage;
 	}
 
-	for (i = 0; i < (0x300 << lclp); i++)
-		lzma->literal[i] = kProbInitValue;
-
 	lzma->pbMask = (1 << props->pb) - 1;
 	lzma->lpMask = (0x100 << props->lp) - (0x100 >> props->lc);
 
-	lzma_length_encoder_reset(&lzma->lenEnc);
-	lzma_length_encoder_reset(&lzma->repLenEnc);
+	if (!keep_ratectl)
+		lzma->ratectl = (struct lzma_ratectl) {
+			.target = props->target_speed * 1000000ULL,
+			.max_nice_len = props->mf.nice_len,
+			.max_depth = props->mf.depth,
+		};
+	lzma_encoder_reset_state(lzma);
 	return 0;
 }
 
-void lzma_default_properties(struct lzma_properties *p, int level)
+static void lzma_encoder_destroy(struct lzma_encoder *lzma)
 {
-	if (level < 0)
-		level = 5;
+	lzma_mf_free(&lzma->mf);
+	lzma_table_free(lzma->allocator, lzma->literal,
+			(0x300 << (lzma->lc + lzma->lp)) * sizeof(probability),
+			lzma->hugepage);
+	lzma_table_free(lzma->allocator, lzma->fast.matches,
+			lzma->matches_size * sizeof(struct lzma_match), false);
+	free(lzma);
+}
+
+/*
+ * Warm encoder contexts are kept per thread (so no locking at all) and
+ * looked up by (dictsize, lc + lp), which decide the size of the large
+ * tables. Thus a context from lzma_encoder_get() usually just needs its
+ * probabilities reset instead of allocating and freeing tables again.
+ */
+#define LZMA_ENCODER_POOL_SIZE	4
+
+static __thread struct lzma_encoder_pool {
+	/* idle contexts, the most recently used one comes last */
+	struct lzma_encoder *idle[LZMA_ENCODER_POOL_SIZE];
+	unsigned int nr;
+} lzma_encoder_pool;
+
+int lzma_encoder_get(struct lzma_encoder **lzmap,
+		     const struct lzma_properties *props)
+{
+	struct lzma_encoder_pool *pool = &lzma_encoder_pool;
+	struct lzma_encoder *lzma = NULL;
+	unsigned int i;
+	int err;
+
+	for (i = pool->nr; i; --i) {
+		struct lzma_encoder *e = pool->idle[i - 1];
+
+		if (e->mf.max_distance + 1 == props->mf.dictsize &&
+		    e->lc + e->lp == props->lc + props->lp) {
+			lzma = e;
+			memmove(pool->idle + i - 1, pool->idle + i,
+				(pool->nr - i) * sizeof(pool->idle[0]));
+			--pool->nr;
+			break;
+		}
+	}
+
+	if (!lzma) {
+		/* calloc() only guarantees 16 bytes for the aligned models */
+		if (posix_memalign((void **)&lzma, __alignof__(*lzma),
+				   sizeof(*lzma)))
+			return -ENOMEM;
+		memset(lzma, 0, sizeof(*lzma));
+	}
 
-	p->lc = 3;
-	p->lp = 0;
-	p->pb = 2;
-	p->mf.nice_len = (level < 7 ? 32 : 64);	/* LZMA SDK numFastBytes */
-	p->mf.depth = (16 + (p->mf.nice_len >> 1)) >> 1;
+	err = lzma_encoder_reset(lzma, props);
+	if (err) {
+		lzma_encoder_destroy(lzma);
+		return err;
+	}
+	*lzmap = lzma;
+	return 0;
 }
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <fcntl.h>
-#include <unistd.h>
+/* give the context back to the pool of the current thread */
+void lzma_encoder_put(struct lzma_encoder *lzma)
+{
+	struct lzma_encoder_pool *pool = &lzma_encoder_pool;
 
-#if 0
-const char text[] = "HABEABDABABABHHHEAAAAAAAA";
-#elif 0
-const char text[] = "abcde_bcdefgh_abcdefghxxxxxxx";
-#else
-const char text[] = "The only time we actually leave the path spinning is if we're truncating "
-"a small amount and don't actually free an extent, which is not a common "
-"occurrence.  We have to set the path blocking in order to add the "
-"delayed ref anyway, so the first extent we find we set the path to "
-"blocking and stay blocking for the duration of the operation.  With the "
-"upcoming file extent map stuff there will be another case that we have "
-"to have the path blocking, so just swap to blocking always.";
-#endif
+	if (pool->nr >= LZMA_ENCODER_POOL_SIZE) {
+		lzma_encoder_destroy(pool->idle[0]);
+		memmove(pool->idle, pool->idle + 1,
+			--pool->nr * sizeof(pool->idle[0]));
+	}
+	pool->idle[pool->nr++] = lzma;
+}
 
-static const uint8_t lzma_header[] = {
-	0x5D,				/* LZMA model properties (lc, lp, pb) in encoded form */
-	0x00, 0x00, 0x80, 0x00,		/* Dictionary size (32-bit unsigned integer, little-endian) */
-	0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF,		/* Uncompressed size (64-bit unsigned integer, little-endian) */
+/* should be called before a thread exits, or idle contexts are leaked */
+void lzma_encoder_pool_drain(void)
+{
+	struct lzma_encoder_pool *pool = &lzma_encoder_pool;
+
+	while (pool->nr)
+		lzma_encoder_destroy(pool->idle[--pool->nr]);
+}
+
+/*
+ * An encoder snapshot is laid out as the header below, the probabilities
+ * (the model block and then literal coders), matches held for lookahead and
+ * the match finder tables if saved. It's in the native byte order, so it's
+ * only meant to be restored by the same build on the same kind of machine.
+ */
+#define LZMA_SNAPSHOT_MAGIC	0x5a45534e	/* "NSEZ" */
+
+struct lzma_snapshot_header {
+	uint32_t magic;
+	uint32_t lc, lp, pb, dictsize;
+
+	uint32_t state;
+	uint32_t reps[LZMA_NUM_REPS];
+
+	/* pending symbols are kept with indexes of their probabilities */
+	struct lzma_rc_ckpt rc;
+	uint8_t rc_count, rc_pos;
+	uint8_t symbols[RC_SYMBOLS_MAX];
+	uint32_t probs[RC_SYMBOLS_MAX];
+
+	uint32_t matches_count;
+	struct lzma_mf_snapshot mf;
+	uint64_t mftables;	/* bytes of match finder tables, or 0 */
 };
 
-int main(int argc, char *argv[])
+static size_t lzma_snapshot_probs(const struct lzma_encoder *lzma)
 {
-	char *outfile;
-	struct lzma_encoder lzmaenc = {0};
-	struct lzma_properties props = {
-		.mf.dictsize = 65536,
+	return LZMA_NUM_MODEL_PROBS + (0x300 << (lzma->lc + lzma->lp));
+}
+
+size_t lzma_encoder_snapshot_size(const struct lzma_encoder *lzma,
+				  bool with_mf)
+{
+	return sizeof(struct lzma_snapshot_header) +
+		lzma_snapshot_probs(lzma) * sizeof(probability) +
+		lzma->fast.matches_count * sizeof(struct lzma_match) +
+		(with_mf ? lzma_mf_tables_size(&lzma->mf) : 0);
+}
+
+/*
+ * Save all state of an encoder between two __lzma_encode() calls into `buf'
+ * of lzma_encoder_snapshot_size() bytes, so that it can go on from there in
+ * another context (even another process) by lzma_encoder_restore(). The
+ * output produced so far and the input are up to the caller.
+ */
+int lzma_encoder_snapshot(const struct lzma_encoder *lzma, void *buf,
+			  size_t size, bool with_mf)
+{
+	const probability *const models = &lzma->isMatch[0][0];
+	const size_t nlits = 0x300 << (lzma->lc + lzma->lp);
+	struct lzma_snapshot_header h = {
+		.magic = LZMA_SNAPSHOT_MAGIC,
+		.lc = lzma->lc,
+		.lp = lzma->lp,
+		.pb = fls(lzma->pbMask + 1) - 1,
+		.dictsize = lzma->mf.max_distance + 1,
+		.state = lzma->state,
+		.rc_count = lzma->rc.count,
+		.rc_pos = lzma->rc.pos,
+		.matches_count = lzma->fast.matches_count,
+		.mftables = with_mf ? lzma_mf_tables_size(&lzma->mf) : 0,
 	};
-	struct lzma_encoder_destsize dstsize;
-	uint8_t buf[4096];
-	int inf, outf;
+	uint8_t *p = (uint8_t *)buf + sizeof(h);
+	unsigned int i;
+
+	/* workers and destsize rollback keep more state than this */
+	if (lzma->mf.mt || lzma->dstsize)
+		return -EBUSY;
+	if (size < lzma_encoder_snapshot_size(lzma, with_mf))
+		return -ENOSPC;
+
+	memcpy(p, models, LZMA_NUM_MODEL_PROBS * sizeof(probability));
+	p += LZMA_NUM_MODEL_PROBS * sizeof(probability);
+	memcpy(p, lzma->literal, nlits * sizeof(probability));
+	p += nlits * sizeof(probability);
+	memcpy(p, lzma->fast.matches,
+	       h.matches_count * sizeof(struct lzma_match));
+	p += h.matches_count * sizeof(struct lzma_match);
+	lzma_mf_save(&lzma->mf, &h.mf, with_mf ? p : NULL);
+
+	memcpy(h.reps, lzma->reps, sizeof(h.reps));
+	rc_write_checkpoint(&lzma->rc, &h.rc);
+	memcpy(h.symbols, lzma->rc.symbols, sizeof(h.symbols));
+	for (i = lzma->rc.pos; i < lzma->rc.count; ++i) {
+		const probability *prob = lzma->rc.probs[i];
+
+		if (lzma->rc.symbols[i] > RC_BIT_1)
+			continue;
+		if (prob >= models && prob < models + LZMA_NUM_MODEL_PROBS)
+			h.probs[i] = prob - models;
+		else
+			h.probs[i] = LZMA_NUM_MODEL_PROBS +
+				(prob - lzma->literal);
+	}
+	memcpy(buf, &h, sizeof(h));
+	return 0;
+}
 
+/*
+ * Restore a snapshot taken with the same `props' (which have to be passed
+ * again since they aren't saved). `mf.buffer' and `mf.iend' should be set
+ * up to the same input before, since the match finder is rebuilt from the
+ * input if its tables weren't saved.
+ */
+int lzma_encoder_restore(struct lzma_encoder *lzma,
+			 const struct lzma_properties *props,
+			 const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	struct lzma_snapshot_header h;
+	probability *models;
+	size_t nprobs;
+	unsigned int i;
 	int err;
 
-	lzmaenc.mf.buffer = malloc(65536) + 1;
-	lzmaenc.mf.buffer[-1] = 0;
+	if (size < sizeof(h))
+		return -EINVAL;
+	memcpy(&h, p, sizeof(h));
+	if (h.magic != LZMA_SNAPSHOT_MAGIC || h.lc != props->lc ||
+	    h.lp != props->lp || h.pb != props->pb ||
+	    h.dictsize != props->mf.dictsize ||
+	    h.state >= kNumStates || h.rc_pos > h.rc_count ||
+	    h.rc_count > RC_SYMBOLS_MAX)
+		return -EINVAL;
+
+	err = lzma_encoder_reset(lzma, props);
+	if (err)
+		return err;
+
+	models = &lzma->isMatch[0][0];
+	nprobs = lzma_snapshot_probs(lzma);
+	if (h.matches_count > lzma->matches_size)
+		return -EINVAL;
+	lzma->fast.matches_count = h.matches_count;
+	if ((h.mftables && h.mftables != lzma_mf_tables_size(&lzma->mf)) ||
+	    size != lzma_encoder_snapshot_size(lzma, h.mftables))
+		return -EINVAL;
+
+	lzma->state = h.state;
+	memcpy(lzma->reps, h.reps, sizeof(h.reps));
+
+	rc_restore_checkpoint(&lzma->rc, &h.rc);
+	lzma->rc.count = h.rc_count;
+	lzma->rc.pos = h.rc_pos;
+	memcpy(lzma->rc.symbols, h.symbols, sizeof(h.symbols));
+	for (i = h.rc_pos; i < h.rc_count; ++i) {
+		if (h.symbols[i] > RC_BIT_1)
+			continue;
+		if (h.probs[i] >= nprobs)
+			return -EINVAL;
+		if (h.probs[i] < LZMA_NUM_MODEL_PROBS)
+			lzma->rc.probs[i] = models + h.probs[i];
+		else
+			lzma->rc.probs[i] = lzma->literal +
+				(h.probs[i] - LZMA_NUM_MODEL_PROBS);
+	}
+	p += sizeof(h);
 
-	if (argc >= 3) {
-		int len;
+	memcpy(models, p, LZMA_NUM_MODEL_PROBS * sizeof(probability));
+	p += LZMA_NUM_MODEL_PROBS * sizeof(probability);
+	memcpy(lzma->literal, p,
+	       (nprobs - LZMA_NUM_MODEL_PROBS) * sizeof(probability));
+	p += (nprobs - LZMA_NUM_MODEL_PROBS) * sizeof(probability);
+	/* any literal coder could have been used */
+	memset(lzma->littouched, 0xff, sizeof(lzma->littouched));
 
-		inf = open(argv[2], O_RDONLY);
+	memcpy(lzma->fast.matches, p,
+	       h.matches_count * sizeof(struct lzma_match));
+	p += h.matches_count * sizeof(struct lzma_match);
 
-		len = lseek(inf, 0, SEEK_END);
-		if (len >= 65535)
-			len = 65535;
+	return lzma_mf_restore(&lzma->mf, &h.mf, h.mftables ? p : NULL);
+}
 
-		printf("len: %d\n", len);
+/*
+ * Compression level presets. Throughput and ratio (compressed size in % of
+ * the input) were measured with an 8 MB mix of x86-64 object files, built
+ * with gcc -O2 and run on a single core of a slow test machine (xz -0 -T1
+ * runs at 13 MB/s there); use them as relative targets.
+ *
+ *                       with LZMA_PRESET_EXTREME
+ * level   throughput   ratio   throughput   ratio
+ *   0      23 MB/s     25.1%        (no effect)
+ *   1      21 MB/s     23.9%        (no effect)
+ *   2      11 MB/s     20.2%     8.6 MB/s   19.4%
+ *   3      10 MB/s     19.3%     5.9 MB/s   18.8%
+ *   4       9 MB/s     19.1%     4.8 MB/s   18.8%
+ *   5     7.4 MB/s     19.0%     4.5 MB/s   18.7%
+ *   6     7.5 MB/s     18.9%     3.5 MB/s   18.7%
+ *   7     6.2 MB/s     18.8%     2.7 MB/s   18.7%
+ *   8     4.6 MB/s     18.8%     2.3 MB/s   18.7%
+ *   9     3.3 MB/s     18.7%     1.9 MB/s   18.6%
+ *
+ * LZMA_PRESET_EXTREME raises nice_len to kMatchMaxLen and makes the chain
+ * search 4 times deeper (255 at most). Levels 8-9 already use a long
+ * nice_len, so only the deeper search applies to them, which pays off on
+ * large redundant inputs (about 0.5% above) but hardly on small ones.
+ */
+static const struct lzma_preset {
+	enum lzma_parser parser;
+	enum lzma_mf_type mf;
+	uint8_t hashbits;	/* 0 to derive from dictsize */
+	uint16_t nice_len;
+	uint8_t depth;
+	uint32_t dictsize;
+} lzma_presets[] = {
+	/* parser		mf	hashbits nice_len depth dictsize */
+	{ LZMA_PARSER_GREEDY,	LZMA_MF_HT4, 16,  16,	 0, 1U << 18 },
+	{ LZMA_PARSER_GREEDY,	LZMA_MF_HT4, 18,  32,	 0, 1U << 20 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  16,	 4, 1U << 21 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  32,	 8, 1U << 22 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  32,	12, 1U << 22 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  32,	16, 1U << 23 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  64,	24, 1U << 23 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0,  64,	32, 1U << 24 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0, 128,	48, 1U << 25 },
+	{ LZMA_PARSER_FAST,	LZMA_MF_HC4,  0, kMatchMaxLen, 64, 1U << 26 },
+};
 
-		lseek(inf, 0, SEEK_SET);
-		read(inf, lzmaenc.mf.buffer, len);
-		close(inf);
-		lzmaenc.mf.iend = lzmaenc.mf.buffer + len;
-	} else {
-		memcpy(lzmaenc.mf.buffer, text, sizeof(text));
-		lzmaenc.mf.iend = lzmaenc.mf.buffer + sizeof(text);
+int lzma_default_properties(struct lzma_properties *p, int level)
+{
+	const struct lzma_preset *preset;
+	bool extreme;
+
+	if (level < 0)
+		level = 5;
+
+	extreme = level & LZMA_PRESET_EXTREME;
+	level &= ~LZMA_PRESET_EXTREME;
+	if (level >= ARRAY_SIZE(lzma_presets))
+		return -EINVAL;
+	preset = &lzma_presets[level];
+
+	/* anything not listed is off (0) */
+	*p = (struct lzma_properties) {
+		.lc = 3,
+		.lp = 0,
+		.pb = 2,
+		.parser = preset->parser,
+		.mf = {
+			.type = preset->mf,
+			.dictsize = preset->dictsize,
+			.hashbits = preset->hashbits,
+			.nice_len = preset->nice_len,
+			.depth = preset->depth,
+		},
+		.filter = LZMA_FILTER_NONE,
+	};
+
+	if (extreme && preset->mf == LZMA_MF_HC4) {
+		p->mf.nice_len = kMatchMaxLen;
+		p->mf.depth = min_t(uint32_t, p->mf.depth * 4, UINT8_MAX);
 	}
-	lzmaenc.op = buf;
-	lzmaenc.oend = buf + sizeof(buf);
-	lzmaenc.finish = true;
+	return 0;
+}
 
-	lzmaenc.need_eopm = true;
-	dstsize.capacity = 4096 - sizeof(lzma_header); //UINT32_MAX;
-	lzmaenc.dstsize = &dstsize;
+/* the incompressibility estimation samples 16 chunks of 4KiB at most */
+#define LZMA_ESTIMATE_CHUNK	4096
+#define LZMA_ESTIMATE_CHUNKS	16
+#define LZMA_ESTIMATE_HASHBITS	12
 
+struct lzma_estimate {
+	/* interleaved histograms to avoid dependent increments of runs */
+	uint32_t freq[4][256];
+	/* the last position + 1 in the chunk of each 4-byte hash */
+	uint16_t head[1 << LZMA_ESTIMATE_HASHBITS];
 
-	lzma_default_properties(&props, 5);
-	lzma_encoder_reset(&lzmaenc, &props);
+	uint32_t bytes, hits;
+};
+
+/* log2(x) in 1/256 bits, which is accurate to about 0.01 bits */
+static unsigned int lzma_log2_fp8(uint32_t x)
+{
+	const unsigned int k = fls(x) - 1;
+	const uint32_t f = (k >= 8 ? x >> (k - 8) : x << (8 - k)) & 0xff;
+
+	/* log2(1 + f) ~= f + 0.3427 * f * (1 - f) */
+	return (k << 8) + f + ((f * (256 - f) * 88) >> 16);
+}
+
+static void lzma_estimate_chunk(struct lzma_estimate *est,
+				const uint8_t *in, uint32_t len)
+{
+	const uint8_t *ip = in, *const end = in + len;
+	uint32_t i;
+
+	for (; end - ip >= 4; ip += 4) {
+		const uint32_t v = get_unaligned_le32(ip);
+
+		++est->freq[0][v & 0xff];
+		++est->freq[1][(v >> 8) & 0xff];
+		++est->freq[2][(v >> 16) & 0xff];
+		++est->freq[3][v >> 24];
+	}
+	for (; ip < end; ++ip)
+		++est->freq[0][*ip];
+	est->bytes += len;
+
+	/* count positions which have a 4-byte match in the same chunk */
+	memset(est->head, 0, sizeof(est->head));
+	for (i = 0; i + 4 <= len; ++i) {
+		const uint32_t v = get_unaligned32(in + i);
+		const uint32_t h = (v * 2654435761U) >>
+			(32 - LZMA_ESTIMATE_HASHBITS);
+		const uint32_t prev = est->head[h];
+
+		est->head[h] = i + 1;
+		if (prev && get_unaligned32(in + prev - 1) == v)
+			++est->hits;
+	}
+}
+
+/*
+ * Guess whether the input is worth encoding at all (media or encrypted data
+ * aren't), from the order-0 entropy and how many positions have 4-byte
+ * matches in up to 64KiB of samples. Returns true if the block is expected
+ * to save less than `raw_threshold' percent, so it should be stored raw.
+ */
+bool lzma_should_store_raw(const struct lzma_properties *p,
+			   const uint8_t *in, uint32_t len)
+{
+	struct lzma_estimate est = {0};
+	uint64_t bits = 0;
+	unsigned int i, logn;
+
+	if (!p->raw_threshold || !len)
+		return false;
+
+	/* positions in the hash table are 16-bit, so it's fine up to 64KiB */
+	if (len <= LZMA_ESTIMATE_CHUNK * LZMA_ESTIMATE_CHUNKS) {
+		lzma_estimate_chunk(&est, in, len);
+	} else {
+		const uint32_t stride = len / LZMA_ESTIMATE_CHUNKS;
+
+		for (i = 0; i < LZMA_ESTIMATE_CHUNKS; ++i)
+			lzma_estimate_chunk(&est, in + i * stride,
+					    LZMA_ESTIMATE_CHUNK);
+	}
+
+	/* sum of c * (log2(n) - log2(c)), in 1/256 bits */
+	logn = lzma_log2_fp8(est.bytes);
+	for (i = 0; i < 256; ++i) {
+		const uint32_t c = est.freq[0][i] + est.freq[1][i] +
+			est.freq[2][i] + est.freq[3][i];
+
+		if (c)
+			bits += (uint64_t)c * (logn - lzma_log2_fp8(c));
+	}
+
+	/* matched bytes are assumed to be (almost) free */
+	bits = bits * (est.bytes - est.hits) / est.bytes;
+	return bits * 100 >
+		(uint64_t)est.bytes * 8 * 256 * (100 - min(p->raw_threshold, 100U));
+}
+
+/* the properties byte of .lzma (and LZMA2) headers */
+static inline uint8_t lzma_properties_byte(const struct lzma_properties *p)
+{
+	return (p->pb * 5 + p->lp) * 9 + p->lc;
+}
+
+/*
+ * Candidates of lc/lp/pb for lzma_autotune_properties(): the default one
+ * for text, aligned binaries (e.g. RISC code, 32-bit/64-bit tables) and
+ * byte-oriented data without any alignment.
+ */
+static const struct lzma_autotune_trial {
+	uint8_t lc, lp, pb;
+} lzma_autotune_trials[] = {
+	{ 3, 0, 2 }, { 4, 0, 2 }, { 0, 2, 2 },
+	{ 1, 2, 2 }, { 0, 3, 3 }, { 3, 0, 0 },
+};
+
+struct lzma_autotune {
+	const struct lzma_properties *props;
+	const uint8_t *in;
+	uint32_t len;
+
+	/* the next trial to pick up, shared by all workers */
+	unsigned int next;
+	/* the compressed size of each trial, or SIZE_MAX with its error */
+	size_t outsize[ARRAY_SIZE(lzma_autotune_trials)];
+	int err[ARRAY_SIZE(lzma_autotune_trials)];
+};
+
+/* encode the whole input with EOPM into `out' for the compressed size */
+static int lzma_autotune_encode(struct lzma_autotune *at,
+				const struct lzma_properties *props,
+				uint8_t *out, size_t outlen, size_t *outsize)
+{
+	struct lzma_encoder *lzma;
+	int err;
+
+	err = lzma_encoder_get(&lzma, props);
+	if (err)
+		return err;
+
+	/* the input is never written */
+	lzma->mf.buffer = (uint8_t *)at->in;
+	lzma->mf.iend = lzma->mf.buffer + at->len;
+	lzma->op = out;
+	lzma->oend = out + outlen;
+	lzma->finish = true;
+	lzma->need_eopm = true;
+	lzma->dstsize = NULL;
+
+	err = __lzma_encode(lzma);
+	/* -ERANGE means that all input is encoded */
+	if (err == -ERANGE) {
+		err = -ENOSPC;
+		if (!rc_encode(&lzma->rc, &lzma->op, lzma->oend)) {
+			encode_eopm(lzma);
+			rc_flush(&lzma->rc);
+			if (!rc_encode(&lzma->rc, &lzma->op, lzma->oend)) {
+				*outsize = lzma->op - out;
+				err = 0;
+			}
+		}
+	}
+	lzma_encoder_put(lzma);
+	return err;
+}
+
+static void *lzma_autotune_worker(void *arg)
+{
+	struct lzma_autotune *at = arg;
+	/* larger outputs lose anyway, so there is no need to finish them */
+	const size_t outlen = at->len + at->len / 8 + 64;
+	uint8_t *out = malloc(outlen);
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&at->next, 1, __ATOMIC_RELAXED)) <
+	       ARRAY_SIZE(lzma_autotune_trials)) {
+		struct lzma_properties props = *at->props;
+
+		props.lc = lzma_autotune_trials[i].lc;
+		props.lp = lzma_autotune_trials[i].lp;
+		props.pb = lzma_autotune_trials[i].pb;
+		at->outsize[i] = SIZE_MAX;
+		if (!out)
+			at->err[i] = -ENOMEM;
+		else
+			at->err[i] = lzma_autotune_encode(at, &props, out,
+							  outlen,
+							  &at->outsize[i]);
+	}
+	free(out);
+	return NULL;
+}
+
+/* the context of the caller is kept warm for later use, but not these */
+static void *lzma_autotune_thread(void *arg)
+{
+	lzma_autotune_worker(arg);
+	lzma_encoder_pool_drain();
+	return NULL;
+}
+
+/*
+ * Encode `in' (a sample or the whole block) with each lc/lp/pb candidate
+ * on up to `nthreads' worker threads, and update `props' to the one with
+ * the smallest output. Returns the properties byte of the chosen one.
+ */
+int lzma_autotune_properties(struct lzma_properties *props,
+			     const uint8_t *in, uint32_t len,
+			     unsigned int nthreads)
+{
+	struct lzma_autotune at = { .props = props, .in = in, .len = len };
+	pthread_t workers[ARRAY_SIZE(lzma_autotune_trials)];
+	unsigned int i, nr, best;
+
+	if (!nthreads || nthreads > ARRAY_SIZE(workers))
+		nthreads = ARRAY_SIZE(workers);
+
+	/* the caller takes a part of the work as well */
+	for (nr = 0; nr < nthreads - 1; ++nr)
+		if (pthread_create(&workers[nr], NULL,
+				   lzma_autotune_thread, &at))
+			break;
+	lzma_autotune_worker(&at);
+	for (i = 0; i < nr; ++i)
+		pthread_join(workers[i], NULL);
+
+	best = 0;
+	for (i = 1; i < ARRAY_SIZE(lzma_autotune_trials); ++i)
+		if (at.outsize[i] < at.outsize[best])
+			best = i;
+	ez_trace(lzma_autotune, best, at.outsize[best], len);
+
+	/* all trials failed, e.g. the output expanded too much */
+	if (at.outsize[best] == SIZE_MAX)
+		return at.err[best];
+
+	props->lc = lzma_autotune_trials[best].lc;
+	props->lp = lzma_autotune_trials[best].lp;
+	props->pb = lzma_autotune_trials[best].pb;
+	return lzma_properties_byte(props);
+}
+
+/*
+ * LZMA2 chunks have 16-bit compressed sizes, so each one takes up to 64KiB
+ * of input and is stored uncompressed if it doesn't fit (or expand) then.
+ * The worst case of LZMA is about 9.5 bytes per input byte (2-byte matches
+ * with the least probable bits), which bounds the scratch buffer.
+ */
+#define LZMA2_CHUNK_MAX		(1U << 16)
+#define LZMA2_CHUNK_BUFSIZE	(LZMA2_CHUNK_MAX * 10 + 64)
+
+/* the dictionary size byte of the LZMA2 filter properties */
+static uint8_t lzma2_dict_byte(uint32_t dictsize)
+{
+	unsigned int d;
+
+	for (d = 0; d < 40; ++d)
+		if (dictsize <= (2U | (d & 1)) << (d / 2 + 11))
+			break;
+	return d;
+}
+
+struct lzma2_chunker {
+	uint8_t *op, *oend;
+	uint8_t propsbyte;
+	/* reset flags needed by the next LZMA chunk */
+	bool dict_reset, props_reset, state_reset;
+};
+
+static int lzma2_put_lzma_chunk(struct lzma2_chunker *c, const uint8_t *cbuf,
+				uint32_t csize, uint32_t usize)
+{
+	uint8_t control = 0x80;
+
+	if (c->dict_reset)
+		control = 0xE0;
+	else if (c->props_reset)
+		control = 0xC0;
+	else if (c->state_reset)
+		control = 0xA0;
+
+	if (c->oend - c->op < 6 + csize)
+		return -ENOSPC;
+
+	*c->op++ = control | ((usize - 1) >> 16);
+	*c->op++ = (usize - 1) >> 8;
+	*c->op++ = usize - 1;
+	*c->op++ = (csize - 1) >> 8;
+	*c->op++ = csize - 1;
+	if (control >= 0xC0)
+		*c->op++ = c->propsbyte;
+	memcpy(c->op, cbuf, csize);
+	c->op += csize;
+	c->dict_reset = c->props_reset = c->state_reset = false;
+	return 0;
+}
+
+static int lzma2_put_uncompressed(struct lzma2_chunker *c,
+				  const uint8_t *ip, uint32_t usize)
+{
+	while (usize) {
+		const uint32_t n = min(usize, LZMA2_CHUNK_MAX);
+
+		if (c->oend - c->op < 3 + n)
+			return -ENOSPC;
+
+		/* 1: with a dictionary reset, 2: without */
+		*c->op++ = c->dict_reset ? 1 : 2;
+		*c->op++ = (n - 1) >> 8;
+		*c->op++ = n - 1;
+		memcpy(c->op, ip, n);
+		c->op += n;
+		ip += n;
+		usize -= n;
+
+		if (c->dict_reset) {
+			c->dict_reset = false;
+			c->props_reset = true;
+		}
+	}
+	/* the decoder didn't see the symbols, so the next chunk resets */
+	c->state_reset = true;
+	return 0;
+}
+
+/*
+ * Store a chunk which isn't worth encoding (see lzma_should_store_raw()).
+ * The match finder still goes over it so that later chunks can refer to
+ * it, but no symbol is encoded at all.
+ */
+static int lzma2_store_raw(struct lzma_encoder *lzma, struct lzma2_chunker *c,
+			   uint32_t start, uint32_t usize)
+{
+	struct lzma_mf *const mf = &lzma->mf;
+
+	ez_trace(lzma2_store_raw, start, usize);
+	/* positions peeked by the parser were inserted already */
+	lzma_mf_skip(mf, start + usize - mf->cur);
+	mf->lookahead = 0;
+	lzma->fast.matches_count = 0;
+
+	lzma_encoder_reset_state(lzma);
+	return lzma2_put_uncompressed(c, mf->buffer + start, usize);
+}
+
+/*
+ * Encode the whole input of a freshly reset encoder as LZMA2 chunks to
+ * [*opp, oend), including the end marker.
+ */
+static int lzma2_encode(struct lzma_encoder *lzma,
+			const struct lzma_properties *props,
+			uint8_t **opp, uint8_t *oend)
+{
+	struct lzma2_chunker c = {
+		.op = *opp, .oend = oend,
+		.propsbyte = lzma_properties_byte(props),
+		.dict_reset = true,
+	};
+	struct lzma_mf *const mf = &lzma->mf;
+	uint8_t *const iend = mf->iend;
+	uint8_t *cbuf;
+	uint32_t pos = 0;
+	int err = 0;
+
+	cbuf = malloc(LZMA2_CHUNK_BUFSIZE);
+	if (!cbuf)
+		return -ENOMEM;
+
+	lzma->need_eopm = false;
+	lzma->dstsize = NULL;
+	do {
+		const uint32_t start = pos;
+		uint32_t csize, usize;
+
+		mf->iend = iend - mf->buffer - pos > LZMA2_CHUNK_MAX ?
+			mf->buffer + pos + LZMA2_CHUNK_MAX : iend;
+		lzma->finish = (mf->iend == iend);
+
+		/* incompressible data is stored before encoding anything */
+		usize = mf->iend - mf->buffer - start;
+		if (lzma_should_store_raw(props, mf->buffer + start, usize)) {
+			err = lzma2_store_raw(lzma, &c, start, usize);
+			pos = start + usize;
+			continue;
+		}
+
+		lzma->op = cbuf;
+		lzma->oend = cbuf + LZMA2_CHUNK_BUFSIZE;
+
+		/* -ERANGE means that all input available has been encoded */
+		err = __lzma_encode(lzma);
+		if (err != -ERANGE)
+			break;
+		err = -ENOSPC;
+		if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+			break;
+		rc_flush(&lzma->rc);
+		if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+			break;
+
+		pos = mf->cur - mf->lookahead;
+		usize = pos - start;
+		csize = lzma->op - cbuf;
+		if (!usize) {
+			err = 0;
+			continue;
+		}
+
+		if (csize <= LZMA2_CHUNK_MAX && csize < usize) {
+			err = lzma2_put_lzma_chunk(&c, cbuf, csize, usize);
+		} else {
+			err = lzma2_put_uncompressed(&c, mf->buffer + start,
+						     usize);
+			lzma_encoder_reset_state(lzma);
+		}
+	} while (!err && !lzma->finish);
+
+	free(cbuf);
+	mf->iend = iend;
+	if (err)
+		return err;
+
+	if (c.op >= c.oend)
+		return -ENOSPC;
+	*c.op++ = 0x00;		/* end of LZMA2 stream */
+	*opp = c.op;
+	return 0;
+}
+
+/*
+ * Each match finder worker inserts up to a dictionary of data before its
+ * segment, so segments are made as large as possible but still enough to
+ * keep all workers busy.
+ */
+#define LZMA_MF_MT_SEGSIZE_MIN	(256U << 10)
+
+static uint32_t lzma_mf_mt_segsize(const struct lzma_properties *props,
+				   unsigned int nthreads, size_t len)
+{
+	const size_t segsize = min_t(size_t, props->mf.dictsize,
+				     len / (2 * nthreads));
+
+	return max_t(size_t, segsize, LZMA_MF_MT_SEGSIZE_MIN);
+}
+
+/*
+ * Workers search every position (inline search skips those within matches)
+ * and insert history again for each segment, so in total they take 4-7
+ * times the CPU of inline match finding at level 5. Going by the CPU time
+ * of each thread, fewer than 4 workers are slower than inline search even
+ * with a core each, so use them only with enough cores and input to keep
+ * that many busy. The output is the same at levels 1-3 and within a few
+ * bytes at higher ones either way.
+ */
+#define LZMA_MF_MT_THREADS_MIN	4
+
+static unsigned int lzma_mf_mt_threads(const struct lzma_properties *props,
+				       size_t len)
+{
+	const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nthreads = props->mf_threads;
+
+	/* the encoder itself takes one */
+	if (ncpus > 0)
+		nthreads = min_t(unsigned long, nthreads, ncpus - 1);
+	if (nthreads < LZMA_MF_MT_THREADS_MIN ||
+	    len < 2ULL * nthreads * LZMA_MF_MT_SEGSIZE_MIN)
+		return 0;
+	return nthreads;
+}
+
+enum lzma_check {
+	LZMA_CHECK_NONE		= 0,
+	LZMA_CHECK_CRC32	= 1,
+	LZMA_CHECK_CRC64	= 4,
+};
+
+#define XZ_STREAM_HEADER_SIZE	12
+#define XZ_BLOCK_HEADER_SIZE	12
+
+static const uint8_t xz_header_magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t xz_footer_magic[2] = { 'Y', 'Z' };
+
+static unsigned int xz_check_size(enum lzma_check check)
+{
+	return check == LZMA_CHECK_CRC64 ? 8 : check == LZMA_CHECK_CRC32 ? 4 : 0;
+}
+
+static unsigned int xz_put_varint(uint8_t *p, uint64_t v)
+{
+	unsigned int i = 0;
+
+	while (v >= 0x80) {
+		p[i++] = v | 0x80;
+		v >>= 7;
+	}
+	p[i++] = v;
+	return i;
+}
+
+static void xz_put_stream_header(uint8_t *p, enum lzma_check check)
+{
+	memcpy(p, xz_header_magic, sizeof(xz_header_magic));
+	p[6] = 0;
+	p[7] = check;
+	put_unaligned_le32(lzma_crc32(p + 6, 2, 0), p + 8);
+}
+
+/*
+ * one block with LZMA2 (optionally after a BCJ or delta filter) and without
+ * optional sizes, which always fits in XZ_BLOCK_HEADER_SIZE
+ */
+static void xz_put_block_header(uint8_t *p, const struct lzma_properties *props)
+{
+	uint8_t *f = p + 2;
+
+	memset(p, 0, XZ_BLOCK_HEADER_SIZE);
+	p[0] = XZ_BLOCK_HEADER_SIZE / 4 - 1;
+	/* number of filters - 1, no compressed/uncompressed size */
+	p[1] = props->filter != LZMA_FILTER_NONE;
+	if (props->filter != LZMA_FILTER_NONE) {
+		*f++ = props->filter;		/* filter ID */
+		if (props->filter == LZMA_FILTER_DELTA) {
+			*f++ = 1;		/* size of filter properties */
+			*f++ = props->delta_dist - 1;
+		} else {
+			*f++ = 0;
+		}
+	}
+	*f++ = 0x21;		/* filter ID: LZMA2 */
+	*f++ = 1;		/* size of filter properties */
+	*f++ = lzma2_dict_byte(props->mf.dictsize);
+	put_unaligned_le32(lzma_crc32(p, 8, 0), p + 8);
+}
+
+struct xz_record {
+	uint64_t unpadded_size;
+	uint64_t uncompressed_size;
+};
+
+/* write the index and the stream footer */
+static int xz_put_index(uint8_t **opp, uint8_t *oend, enum lzma_check check,
+			const struct xz_record *records, uint32_t nr)
+{
+	uint8_t *const start = *opp, *op = start;
+	uint32_t i, size;
+
+	/* indicator + count + 2 varints per record + padding + CRC32 */
+	if (oend - op < 1 + 5 + nr * 18ULL + 3 + 4 + 12)
+		return -ENOSPC;
+
+	*op++ = 0x00;
+	op += xz_put_varint(op, nr);
+	for (i = 0; i < nr; ++i) {
+		op += xz_put_varint(op, records[i].unpadded_size);
+		op += xz_put_varint(op, records[i].uncompressed_size);
+	}
+	while ((op - start) & 3)
+		*op++ = 0;
+	put_unaligned_le32(lzma_crc32(start, op - start, 0), op);
+	op += 4;
+	size = op - start;
+
+	/* stream footer: CRC32, backward size, stream flags, magic */
+	put_unaligned_le32(size / 4 - 1, op + 4);
+	op[8] = 0;
+	op[9] = check;
+	put_unaligned_le32(lzma_crc32(op + 4, 6, 0), op);
+	memcpy(op + 10, xz_footer_magic, sizeof(xz_footer_magic));
+	*opp = op + 12;
+	return 0;
+}
+
+static void xz_put_check(uint8_t *p, enum lzma_check check,
+			 const uint8_t *in, size_t len)
+{
+	if (check == LZMA_CHECK_CRC64) {
+		const uint64_t crc = lzma_crc64(in, len, 0);
+
+		put_unaligned_le32(crc, p);
+		put_unaligned_le32(crc >> 32, p + 4);
+	} else if (check == LZMA_CHECK_CRC32) {
+		put_unaligned_le32(lzma_crc32(in, len, 0), p);
+	}
+}
+
+/*
+ * encode a block (header, LZMA2 data, padding and check), `fbuf' holds
+ * the filtered input if props->filter is set
+ */
+static int xz_encode_block(struct lzma_encoder *lzma,
+			   const struct lzma_properties *props,
+			   enum lzma_check check, const uint8_t *in,
+			   size_t len, uint8_t *fbuf, uint8_t **opp,
+			   uint8_t *oend, struct xz_record *rec)
+{
+	const unsigned int mf_threads = lzma_mf_mt_threads(props, len);
+	uint8_t *const start = *opp;
+	uint8_t *op = start + XZ_BLOCK_HEADER_SIZE;
+	int err;
+
+	if (oend - start < XZ_BLOCK_HEADER_SIZE)
+		return -ENOSPC;
+	xz_put_block_header(start, props);
+
+	if (props->filter != LZMA_FILTER_NONE) {
+		struct lzma_filter f;
+
+		/* filters restart at each block as the decoder does */
+		err = lzma_filter_init(&f, props->filter, props->delta_dist);
+		if (err)
+			return err;
+		lzma_filter_encode(&f, fbuf, in, len, true);
+		lzma->mf.buffer = fbuf;
+	} else {
+		/* the input is never written */
+		lzma->mf.buffer = (uint8_t *)in;
+	}
+	lzma->mf.iend = lzma->mf.buffer + len;
+
+	if (mf_threads) {
+		err = lzma_mf_mt_start(&lzma->mf, &props->mf, mf_threads,
+				       lzma_mf_mt_segsize(props, mf_threads,
+							  len));
+		if (err)
+			return err;
+	}
+	err = lzma2_encode(lzma, props, &op, oend);
+	if (lzma->mf.mt) {
+		const int mterr = lzma_mf_mt_stop(&lzma->mf);
+
+		if (!err)
+			err = mterr;
+	}
+	if (err)
+		return err;
+
+	rec->unpadded_size = op - start + xz_check_size(check);
+	rec->uncompressed_size = len;
+
+	if (oend - op < 3 + xz_check_size(check))
+		return -ENOSPC;
+	while ((op - start) & 3)
+		*op++ = 0;
+	xz_put_check(op, check, in, len);
+	*opp = op + xz_check_size(check);
+	return 0;
+}
+
+/*
+ * Write `in' as an .xz stream with LZMA2 filters to `out', split into
+ * independent blocks of `block_size' bytes of input (0 for a single block).
+ * The index of .xz maps uncompressed offsets to compressed blocks, so a
+ * reader can locate and decode just one block for random access (e.g.
+ * lzma_index_iter_locate() of liblzma).
+ * `*outlen' is the size of `out' and then updated to the stream size.
+ */
+int lzma_xz_encode_seekable(const struct lzma_properties *props,
+			    enum lzma_check check, size_t block_size,
+			    const uint8_t *in, size_t len,
+			    uint8_t *out, size_t *outlen)
+{
+	uint8_t *op = out, *const oend = out + *outlen;
+	struct lzma_properties bprops = *props;
+	struct lzma_encoder *lzma = NULL;
+	struct xz_record *records;
+	struct lzma_filter f;
+	uint8_t *fbuf = NULL;
+	uint32_t i, nr;
+	int err;
+
+	if (!block_size || block_size > len)
+		block_size = max_t(size_t, len, 1);
+	nr = DIV_ROUND_UP(len, block_size);
+
+	/* no block needs a dictionary larger than itself */
+	if (bprops.mf.dictsize > block_size)
+		bprops.mf.dictsize = max_t(size_t, block_size, 4096);
+
+	/* LZMA2 limits lc + lp, and positions of mf are 32-bit */
+	if (props->lc + props->lp > 4 || props->pb > LZMA_PB_MAX)
+		return -EINVAL;
+	if (block_size > UINT32_MAX - bprops.mf.dictsize)
+		return -EFBIG;
+	if (*outlen < XZ_STREAM_HEADER_SIZE)
+		return -ENOSPC;
+	err = lzma_filter_init(&f, props->filter, props->delta_dist);
+	if (err)
+		return err;
+
+	/* an empty input has no block at all, but malloc(0) may fail */
+	records = malloc(max(nr, 1U) * sizeof(*records));
+	if (!records)
+		return -ENOMEM;
+	if (props->filter != LZMA_FILTER_NONE) {
+		fbuf = malloc(block_size);
+		if (!fbuf) {
+			free(records);
+			return -ENOMEM;
+		}
+	}
+
+	xz_put_stream_header(op, check);
+	op += XZ_STREAM_HEADER_SIZE;
+
+	err = lzma_encoder_get(&lzma, &bprops);
+	for (i = 0; !err && i < nr; ++i) {
+		const size_t offset = (size_t)i * block_size;
+
+		/* each block starts from scratch, tables are kept though */
+		if (i)
+			err = lzma_encoder_reset(lzma, &bprops);
+		if (!err)
+			err = xz_encode_block(lzma, &bprops, check, in + offset,
+					      min(block_size, len - offset),
+					      fbuf, &op, oend, &records[i]);
+	}
+	if (lzma)
+		lzma_encoder_put(lzma);
+	free(fbuf);
+
+	if (!err)
+		err = xz_put_index(&op, oend, check, records, nr);
+	free(records);
+	if (err)
+		return err;
+	*outlen = op - out;
+	return 0;
+}
+
+/* write `in' as a single-block .xz stream, see lzma_xz_encode_seekable() */
+int lzma_xz_encode(const struct lzma_properties *props, enum lzma_check check,
+		   const uint8_t *in, size_t len, uint8_t *out, size_t *outlen)
+{
+	return lzma_xz_encode_seekable(props, check, 0, in, len, out, outlen);
+}
+
+/*
+ * encode as much input of `lzma' as fits in `capacity' bytes with EOPM,
+ * and return how many input bytes it holds and the output size
+ */
+static int lzma_encode_destsize(struct lzma_encoder *lzma, uint8_t *out,
+				uint32_t capacity, uint32_t *consumed,
+				uint32_t *produced)
+{
+	struct lzma_encoder_destsize dstsize = { .capacity = capacity };
+	int err;
+
+	lzma->op = out;
+	lzma->oend = out + capacity;
+	lzma->finish = true;
+	lzma->need_eopm = true;
+	lzma->dstsize = &dstsize;
+
+	err = __lzma_encode(lzma);
+	/* `dstsize' is on the stack, so never leave it behind in `lzma' */
+	lzma->dstsize = NULL;
+	if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+		return -ENOSPC;
+
+	if (err == -ENOSPC) {
+		/* the cluster is full, end it as checkpointed */
+		memcpy(lzma->op, dstsize.ending, dstsize.esz);
+		lzma->op += dstsize.esz;
+		*consumed = dstsize.inpos;
+	} else if (err == -ERANGE) {
+		encode_eopm(lzma);
+		rc_flush(&lzma->rc);
+		if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+			return -ENOSPC;
+		*consumed = lzma->mf.cur - lzma->mf.lookahead;
+	} else {
+		return err;
+	}
+	DBG_BUGON(lzma->op > lzma->oend);
+	*produced = lzma->op - out;
+	return 0;
+}
+
+struct lzma_pack_input {
+	const uint8_t *buf;
+	uint32_t len;
+};
+
+/*
+ * Tail packing: encode `n' small inputs (e.g. small files and file tails)
+ * back to back into fixed-size clusters of `clustersize' bytes, each of
+ * which is an independent raw LZMA stream with EOPM filled up by the
+ * destsize machinery. Inputs can cross cluster boundaries.
+ *
+ * `*nclusters' is the number of clusters `out' can hold, and then updated
+ * to how many are used. For random access, `in_offsets[i]' is set to where
+ * input i starts in the concatenated stream, and `cluster_offsets[k]' to
+ * where cluster k starts (with the total length at `cluster_offsets[k+1]'),
+ * so `cluster_offsets' needs the room of `*nclusters + 1' entries.
+ */
+int lzma_pack_tails(const struct lzma_properties *props,
+		    const struct lzma_pack_input *inputs, unsigned int n,
+		    uint32_t clustersize, uint8_t *out, uint32_t *nclusters,
+		    uint64_t *in_offsets, uint64_t *cluster_offsets)
+{
+	struct lzma_encoder *lzma = NULL;
+	uint64_t total = 0, pos = 0;
+	uint8_t *buf;
+	uint32_t k = 0;
+	unsigned int i;
+	int err;
+
+	if (clustersize < 2 * (LZMA_REQUIRED_INPUT_MAX + 5))
+		return -EINVAL;
+
+	for (i = 0; i < n; ++i) {
+		in_offsets[i] = total;
+		total += inputs[i].len;
+	}
+	/* positions of mf are 32-bit */
+	if (total > UINT32_MAX - props->mf.dictsize)
+		return -EFBIG;
+
+	buf = malloc(max_t(uint64_t, total, 1));
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < n; ++i)
+		memcpy(buf + in_offsets[i], inputs[i].buf, inputs[i].len);
+
+	err = lzma_encoder_get(&lzma, props);
+	while (!err && pos < total) {
+		uint8_t *const cluster = out + (size_t)k * clustersize;
+		uint32_t consumed = 0, produced;
+
+		if (k >= *nclusters) {
+			err = -ENOSPC;
+			break;
+		}
+
+		/* clusters are independent, so each one starts from scratch */
+		if (k)
+			err = lzma_encoder_reset(lzma, props);
+		if (err)
+			break;
+		lzma->mf.buffer = buf + pos;
+		lzma->mf.iend = buf + total;
+
+		err = lzma_encode_destsize(lzma, cluster, clustersize,
+					   &consumed, &produced);
+		/* not even a symbol fits, which shouldn't happen */
+		if (!err && !consumed)
+			err = -ENOSPC;
+		if (err)
+			break;
+		memset(cluster + produced, 0, clustersize - produced);
+		cluster_offsets[k++] = pos;
+		pos += consumed;
+	}
+	if (lzma)
+		lzma_encoder_put(lzma);
+	free(buf);
+	if (err)
+		return err;
+
+	cluster_offsets[k] = total;
+	*nclusters = k;
+	return 0;
+}
+
+/*
+ * an independent buffer to encode by lzma_encode_batch(), which is filled
+ * up to `capacity' as the destsize mode does and reports how much input is
+ * encoded (`consumed') into how many bytes (`produced')
+ */
+struct lzma_batch_item {
+	const uint8_t *in;
+	uint32_t inlen;
+	uint8_t *out;
+	uint32_t capacity;
+
+	uint32_t consumed, produced;
+	int err;
+};
+
+struct lzma_batch {
+	const struct lzma_properties *props;
+	struct lzma_batch_item *items;
+	size_t n, grain;
+	size_t next;
+
+	/* the earlier identical item to copy from for each one, or itself */
+	size_t *origin;
+	struct lzma_dedup_stats stats;
+};
+
+static void lzma_batch_encode_item(struct lzma_encoder *lzma,
+				   const struct lzma_properties *props,
+				   struct lzma_batch_item *it)
+{
+	it->consumed = it->produced = 0;
+	it->err = lzma_encoder_reset(lzma, props);
+	if (it->err)
+		return;
+
+	/* the input is never written */
+	lzma->mf.buffer = (uint8_t *)it->in;
+	lzma->mf.iend = lzma->mf.buffer + it->inlen;
+	it->err = lzma_encode_destsize(lzma, it->out, it->capacity,
+				       &it->consumed, &it->produced);
+	if (!it->err && !it->consumed && it->inlen)
+		it->err = -ENOSPC;
+}
+
+static void *lzma_batch_worker(void *arg)
+{
+	struct lzma_batch *b = arg;
+	struct lzma_encoder *lzma;
+	size_t i, end;
+	int err;
+
+	/* a warm context for all items taken by this thread */
+	err = lzma_encoder_get(&lzma, b->props);
+	while ((i = __atomic_fetch_add(&b->next, b->grain,
+				       __ATOMIC_RELAXED)) < b->n) {
+		for (end = min(i + b->grain, b->n); i < end; ++i) {
+			if (b->origin && b->origin[i] != i)
+				continue;
+			if (err)
+				b->items[i].err = err;
+			else
+				lzma_batch_encode_item(lzma, b->props,
+						       &b->items[i]);
+		}
+	}
+	if (!err)
+		lzma_encoder_put(lzma);
+	return NULL;
+}
+
+/*
+ * Find items identical to an earlier one. Given the same capacity, they'd
+ * be encoded into the same output, so it's copied after the workers are
+ * done instead. Items with a different capacity are encoded as usual.
+ */
+static int lzma_batch_dedup(struct lzma_batch *b)
+{
+	struct lzma_dedup d;
+	size_t i;
+	int err;
+
+	b->origin = malloc(b->n * sizeof(*b->origin));
+	if (!b->origin)
+		return -ENOMEM;
+	err = lzma_dedup_init(&d, 8);
+	if (err)
+		return err;
+
+	for (i = 0; !err && i < b->n; ++i) {
+		const struct lzma_batch_item *it = &b->items[i];
+		struct lzma_dedup_key key;
+		struct lzma_dedup_ref ref;
+
+		b->origin[i] = i;
+		if (lzma_dedup_lookup(&d, it->in, it->inlen, &key, &ref)) {
+			if (b->items[ref.offset].capacity == it->capacity) {
+				b->origin[i] = ref.offset;
+				continue;
+			}
+			/* encoded again, so it's no hit for the caller */
+			--d.stats.hits;
+			d.stats.hit_bytes -= it->inlen;
+			continue;
+		}
+		/* the size is recorded in `hit_outbytes' once encoded */
+		ref = (struct lzma_dedup_ref) { .offset = i };
+		err = lzma_dedup_insert(&d, &key, it->in, &ref);
+	}
+	b->stats = d.stats;
+	lzma_dedup_exit(&d);
+	return err;
+}
+
+/* the context of the caller is kept warm for the next batch, but not these */
+static void *lzma_batch_thread(void *arg)
+{
+	lzma_batch_worker(arg);
+	lzma_encoder_pool_drain();
+	return NULL;
+}
+
+/*
+ * Encode `n' independent small buffers on up to `nthreads' threads (the
+ * caller included). Each thread takes items in small groups and encodes
+ * them with one context of its own, so only the state is reset for each
+ * item. The dictionary is limited to the largest input, which keeps match
+ * finder tables small (and compact) for small buffers. With `props->dedup',
+ * items identical to an earlier one are not encoded again but copied, and
+ * how many are reported in `*stats' if not NULL (all 0 without dedup).
+ * Returns 0 if all items succeed, or the error of the first failing one.
+ */
+int lzma_encode_batch(const struct lzma_properties *props,
+		      struct lzma_batch_item *items, size_t n,
+		      unsigned int nthreads, struct lzma_dedup_stats *stats)
+{
+	struct lzma_properties bprops = *props;
+	struct lzma_batch b = { .props = &bprops, .items = items, .n = n };
+	pthread_t *workers = NULL;
+	uint32_t maxlen = 0;
+	unsigned int i, nr = 0;
+	size_t j;
+
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	if (!n)
+		return 0;
+
+	for (j = 0; j < n; ++j)
+		maxlen = max(maxlen, items[j].inlen);
+	if (bprops.mf.dictsize > maxlen)
+		bprops.mf.dictsize = max_t(uint32_t, maxlen, 4096);
+
+	/* dedup is only a shortcut, so just encode everything if it fails */
+	if (props->dedup && lzma_batch_dedup(&b)) {
+		free(b.origin);
+		b.origin = NULL;
+		memset(&b.stats, 0, sizeof(b.stats));
+	}
+
+	if (!nthreads)
+		nthreads = 1;
+	/* a few groups per thread at least to balance the load */
+	b.grain = min_t(size_t, max_t(size_t, n / (nthreads * 8), 1), 64);
+
+	if (nthreads > 1)
+		workers = malloc((nthreads - 1) * sizeof(*workers));
+	for (i = 0; workers && i < nthreads - 1; ++i, ++nr)
+		if (pthread_create(&workers[i], NULL, lzma_batch_thread, &b))
+			break;
+	lzma_batch_worker(&b);
+	for (i = 0; i < nr; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	/* origins come first, so they're done before copied again */
+	for (j = 0; b.origin && j < n; ++j) {
+		const struct lzma_batch_item *src = &items[b.origin[j]];
+
+		if (b.origin[j] == j)
+			continue;
+		items[j].consumed = src->consumed;
+		items[j].produced = src->produced;
+		items[j].err = src->err;
+		if (!src->err) {
+			memcpy(items[j].out, src->out, src->produced);
+			b.stats.hit_outbytes += src->produced;
+		}
+	}
+	free(b.origin);
+	if (stats)
+		*stats = b.stats;
+
+	for (j = 0; j < n; ++j)
+		if (items[j].err)
+			return items[j].err;
+	return 0;
+}
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if 0
+const char text[] = "HABEABDABABABHHHEAAAAAAAA";
+#elif 0
+const char text[] = "abcde_bcdefgh_abcdefghxxxxxxx";
+#else
+const char text[] = "The only time we actually leave the path spinning is if we're truncating "
+"a small amount and don't actually free an extent, which is not a common "
+"occurrence.  We have to set the path blocking in order to add the "
+"delayed ref anyway, so the first extent we find we set the path to "
+"blocking and stay blocking for the duration of the operation.  With the "
+"upcoming file extent map stuff there will be another case that we have "
+"to have the path blocking, so just swap to blocking always.";
+#endif
+
+static uint8_t lzma_header[] = {
+	0x5D,				/* LZMA model properties (lc, lp, pb) in encoded form */
+	0x00, 0x00, 0x80, 0x00,		/* Dictionary size (32-bit unsigned integer, little-endian) */
+	0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF,		/* Uncompressed size (64-bit unsigned integer, little-endian) */
+};
+
+int main(int argc, char *argv[])
+{
+	char *outfile;
+	struct lzma_encoder lzmaenc = {0};
+	struct lzma_properties props = {0};
+	struct lzma_encoder_destsize dstsize;
+	uint8_t buf[4096];
+	int inf, outf, level = 5;
+
+	int err;
+
+	lzmaenc.mf.buffer = malloc(65536) + 1;
+	lzmaenc.mf.buffer[-1] = 0;
+
+	if (argc >= 3) {
+		int len;
+
+		inf = open(argv[2], O_RDONLY);
+
+		len = lseek(inf, 0, SEEK_END);
+		if (len >= 65535)
+			len = 65535;
+
+		printf("len: %d\n", len);
+
+		lseek(inf, 0, SEEK_SET);
+		read(inf, lzmaenc.mf.buffer, len);
+		close(inf);
+		lzmaenc.mf.iend = lzmaenc.mf.buffer + len;
+	} else {
+		memcpy(lzmaenc.mf.buffer, text, sizeof(text));
+		lzmaenc.mf.iend = lzmaenc.mf.buffer + sizeof(text);
+	}
+	lzmaenc.op = buf;
+	lzmaenc.oend = buf + sizeof(buf);
+	lzmaenc.finish = true;
+
+	lzmaenc.need_eopm = true;
+	dstsize.capacity = 4096 - sizeof(lzma_header); //UINT32_MAX;
+
+
+	if (argc >= 4)
+		level = atoi(argv[3]);
+
+	err = lzma_default_properties(&props, level);
+	if (err) {
+		fprintf(stderr, "invalid level %d\n", level);
+		return 1;
+	}
+	props.mf.dictsize = 65536;	/* the default cluster size */
+
+	if (argc >= 2 && strlen(argv[1]) > 3 &&
+	    !strcmp(argv[1] + strlen(argv[1]) - 3, ".xz")) {
+		size_t len = lzmaenc.mf.iend - lzmaenc.mf.buffer;
+		size_t outlen = len + len / 8 + 1024;
+		uint8_t *out = malloc(outlen);
+
+		/*
+		 * an optional filter: x86, arm64 or delta:<distance>, or
+		 * raw:<percent> to store blocks saving less than that raw
+		 */
+		if (argc >= 5 && !strcmp(argv[4], "x86")) {
+			props.filter = LZMA_FILTER_X86;
+		} else if (argc >= 5 && !strcmp(argv[4], "arm64")) {
+			props.filter = LZMA_FILTER_ARM64;
+		} else if (argc >= 5 && !strncmp(argv[4], "delta:", 6)) {
+			props.filter = LZMA_FILTER_DELTA;
+			props.delta_dist = atoi(argv[4] + 6);
+		} else if (argc >= 5 && !strncmp(argv[4], "raw:", 4)) {
+			props.raw_threshold = atoi(argv[4] + 4);
+		}
+
+		err = lzma_xz_encode(&props, LZMA_CHECK_CRC64,
+				     lzmaenc.mf.buffer, len, out, &outlen);
+		printf("xz: %d, encoded length: %lu\n", err, outlen);
+		/*
+		 * check which way the first LZMA2 chunk went (1: stored), and
+		 * if it was stored without encoding (e.g. random input)
+		 */
+		if (!err && len)
+			printf("first chunk: %s%s\n",
+			       out[XZ_STREAM_HEADER_SIZE +
+				   XZ_BLOCK_HEADER_SIZE] == 1 ?
+			       "stored" : "encoded",
+			       lzma_should_store_raw(&props, lzmaenc.mf.buffer,
+						     min_t(size_t, len,
+							   LZMA2_CHUNK_MAX)) ?
+			       " (skipped encoding)" : "");
+		if (!err) {
+			outf = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			write(outf, out, outlen);
+			close(outf);
+		}
+		free(out);
+		return err;
+	}
+
+	lzma_header[0] = lzma_properties_byte(&props);
+	put_unaligned_le32(props.mf.dictsize, lzma_header + 1);
+	lzma_encoder_reset(&lzmaenc, &props);
+	lzmaenc.dstsize = &dstsize;
 
 	err = __lzma_encode(&lzmaenc);
 
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <ez/unaligned.h>
 #include <ez/bitops.h>
+#include <ez/trace.h>
 #include "mf.h"
 #include "bytehash.h"
 
@@ -27,17 +28,24 @@ static inline uint32_t mt_calc_hash_3(const uint8_t cur[3],
 	return (dualhash ^ (cur[2] << 8)) & (LZMA_HASH_3_SZ - 1);
 }
 
+#define GOLDEN_RATIO_32		0x61C88647U
+
 static inline uint32_t mt_calc_hash_4(const uint8_t cur[4], unsigned int nbits)
 {
-	const uint32_t golden_ratio_32 = 0x61C88647;
-
-	return (get_unaligned_le32(cur) * golden_ratio_32) >> (32 - nbits);
+	return (get_unaligned_le32(cur) * GOLDEN_RATIO_32) >> (32 - nbits);
 }
 
+/* lzma_mf_skip() hashes MF_SKIP_BATCH positions at once if possible */
+typedef uint32_t mf_vec_t __attribute__((vector_size(16)));
+#define MF_SKIP_BATCH		(sizeof(mf_vec_t) / sizeof(uint32_t))
+
+/* the number of positions inserted for each kMatchMaxLen run */
+#define MF_RUN_INSERTS		4
+
 /* Mark the current byte as processed from point of view of the match finder. */
 static void mf_move(struct lzma_mf *mf)
 {
-	if (mf->chaincur + 1 > mf->max_distance)
+	if (mf->chaincur + 1 >= mf->chainsize)
 		mf->chaincur = 0;
 	else
 		++mf->chaincur;
@@ -46,6 +54,117 @@ static void mf_move(struct lzma_mf *mf)
 	DBG_BUGON(mf->buffer + mf->cur > mf->iend);
 }
 
+/* get the chain slot of the position which is `delta' bytes before */
+static inline uint32_t mf_chain_index(const struct lzma_mf *mf,
+				      uint32_t delta)
+{
+	return mf->chaincur >= delta ? mf->chaincur - delta :
+		mf->chainsize + mf->chaincur - delta;
+}
+
+/*
+ * Hash tables are accessed by the following helpers, which hide the compact
+ * layout for dictionaries up to 64KiB: hash heads only keep the low 16 bits
+ * of positions and chain entries are 16-bit distances to the previous
+ * position with the same hash (0 if none). Such entries can alias, so all
+ * candidates are verified against the actual data before use.
+ */
+static inline const void *mf_hash_addr(const struct lzma_mf *mf,
+				       uint32_t idx)
+{
+	return mf->compact ? (void *)&mf->hash16[idx] : (void *)&mf->hash[idx];
+}
+
+/* get the distance of the hash head, and point the head to `pos' instead */
+static inline uint32_t mf_hash_update(struct lzma_mf *mf,
+				      uint32_t idx, uint32_t pos)
+{
+	uint32_t delta;
+
+	if (mf->compact) {
+		delta = (uint16_t)(pos - mf->hash16[idx]);
+		mf->hash16[idx] = pos;
+	} else {
+		delta = pos - mf->hash[idx];
+		mf->hash[idx] = pos;
+	}
+	return delta;
+}
+
+/* insert `pos' into the hash chain of the 4-byte hash `idx' */
+static inline uint32_t mf_chain_insert(struct lzma_mf *mf, uint32_t chaincur,
+				       uint32_t idx, uint32_t pos)
+{
+	uint32_t delta;
+
+	if (mf->compact) {
+		delta = (uint16_t)(pos - mf->hash16[idx]);
+		mf->chain16[chaincur] = delta;
+		mf->hash16[idx] = pos;
+	} else {
+		delta = pos - mf->hash[idx];
+		mf->chain[chaincur] = mf->hash[idx];
+		mf->hash[idx] = pos;
+	}
+	return delta;
+}
+
+/* get the distance of the next candidate after the one `delta' bytes back */
+static inline uint32_t mf_chain_next(const struct lzma_mf *mf,
+				     uint32_t pos, uint32_t delta)
+{
+	const uint32_t idx = mf_chain_index(mf, delta);
+
+	if (mf->compact) {
+		const uint32_t link = mf->chain16[idx];
+
+		return link ? delta + link : UINT32_MAX;
+	}
+	return pos - mf->chain[idx];
+}
+
+/*
+ * Hash the next position in advance and prefetch its buckets, so that
+ * the (likely) cache misses overlap with the work of the current one.
+ */
+static inline void mf_prefetch_hash(const struct lzma_mf *mf,
+				    const uint8_t *ip)
+{
+	const uint32_t dualhash = mt_calc_dualhash(ip);
+
+	prefetchw(mf_hash_addr(mf, LZMA_HASH_3_BASE +
+			       mt_calc_hash_3(ip, dualhash)));
+	prefetchw(mf_hash_addr(mf, LZMA_HASH_4_BASE +
+			       mt_calc_hash_4(ip, mf->hashbits)));
+}
+
+/* prefetch the next candidate in the hash chain as well as its data */
+static inline void mf_prefetch_match(const struct lzma_mf *mf,
+				     const uint8_t *ip, uint32_t delta,
+				     uint32_t limit)
+{
+	if (delta - 1 >= limit)
+		return;
+
+	if (delta < mf->chainsize) {
+		const uint32_t idx = mf_chain_index(mf, delta);
+
+		prefetch(mf->compact ? (void *)&mf->chain16[idx] :
+			 (void *)&mf->chain[idx]);
+	}
+	prefetch(ip - delta);
+}
+
+/*
+ * Candidates are only valid if 0 < delta <= limit, which is checked as
+ * delta - 1 < limit. Limiting to the current position keeps (aliased)
+ * compact entries in the buffer.
+ */
+static inline uint32_t mf_delta_limit(const struct lzma_mf *mf)
+{
+	return min(mf->cur, mf->max_distance);
+}
+
 static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 					struct lzma_match *matches)
 {
@@ -53,30 +172,33 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	const uint8_t *ip = mf->buffer + cur;
 	const uint32_t pos = cur + mf->offset;
 	const uint32_t nice_len = mf->nice_len;
+	const uint32_t limit = mf_delta_limit(mf);
 	const uint8_t *ilimit =
 		ip + nice_len < mf->iend ? ip + nice_len : mf->iend;
 
 	const uint32_t dualhash = mt_calc_dualhash(ip);
 	const uint32_t hash_2 = dualhash & (LZMA_HASH_2_SZ - 1);
-	const uint32_t delta2 = pos - mf->hash[hash_2];
+	const uint32_t delta2 = mf_hash_update(mf, hash_2, pos);
 	const uint32_t hash_3 = mt_calc_hash_3(ip, dualhash);
-	const uint32_t delta3 = pos - mf->hash[LZMA_HASH_3_BASE + hash_3];
+	const uint32_t delta3 = mf_hash_update(mf, LZMA_HASH_3_BASE + hash_3,
+					       pos);
 	const uint32_t hash_value = mt_calc_hash_4(ip, mf->hashbits);
-	uint32_t cur_match = mf->hash[LZMA_HASH_4_BASE + hash_value];
+	uint32_t delta = mf_chain_insert(mf, mf->chaincur,
+					 LZMA_HASH_4_BASE + hash_value, pos);
 	unsigned int bestlen, depth;
 	const uint8_t *matchend;
 	struct lzma_match *mp;
 
-	mf->hash[hash_2] = pos;
-	mf->hash[LZMA_HASH_3_BASE + hash_3] = pos;
-	mf->hash[LZMA_HASH_4_BASE + hash_value] = pos;
-	mf->chain[mf->chaincur] = cur_match;
+	mf_prefetch_match(mf, ip, delta, limit);
+	if (mf->iend - ip > 4)
+		mf_prefetch_hash(mf, ip + 1);
 
 	mp = matches;
 	bestlen = 0;
 
 	/* check the 2-byte match */
-	if (delta2 <= mf->max_distance && *(ip - delta2) == *ip) {
+	if (delta2 - 1 < limit &&
+	    get_unaligned16(ip - delta2) == get_unaligned16(ip)) {
 		matchend = ez_memcmp(ip + 2, ip - delta2 + 2, ilimit);
 
 		bestlen = matchend - ip;
@@ -88,8 +210,9 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	}
 
 	/* check the 3-byte match */
-	if (delta2 != delta3 && delta3 <= mf->max_distance &&
-	    *(ip - delta3) == *ip) {
+	if (delta2 != delta3 && delta3 - 1 < limit &&
+	    get_unaligned16(ip - delta3) == get_unaligned16(ip) &&
+	    *(ip - delta3 + 2) == ip[2]) {
 		matchend = ez_memcmp(ip + 3, ip - delta3 + 3, ilimit);
 
 		if (matchend - ip > bestlen) {
@@ -104,16 +227,19 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 
 	/* check 4 or more byte matches, traversal the whole hash chain */
 	for (depth = mf->depth; depth; --depth) {
-		const uint32_t delta = pos - cur_match;
 		const uint8_t *match = ip - delta;
-		uint32_t nextcur;
+		const uint32_t curdelta = delta;
 
-		if (delta > mf->max_distance)
+		if (delta - 1 >= limit)
 			break;
 
-		nextcur = (mf->chaincur >= delta ? mf->chaincur - delta :
-			   mf->max_distance + 1 + mf->chaincur - delta);
-		cur_match = mf->chain[nextcur];
+		if (delta < mf->chainsize) {
+			delta = mf_chain_next(mf, pos, delta);
+			mf_prefetch_match(mf, ip, delta, limit);
+		} else {
+			/* its chain entry was overwritten, so stop after it */
+			delta = UINT32_MAX;
+		}
 
 		if (get_unaligned32(match) == get_unaligned32(ip) &&
 		    match[bestlen] == ip[bestlen]) {
@@ -124,7 +250,7 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 
 			bestlen = matchend - ip;
 			*(mp++) = (struct lzma_match) { .len = bestlen,
-							.dist = delta };
+							.dist = curdelta };
 
 			if (matchend >= ilimit)
 				break;
@@ -135,6 +261,67 @@ out:
 	return mp - matches;
 }
 
+/*
+ * Insert MF_SKIP_BATCH positions in one go: all hashes are calculated with
+ * vector operations in advance, and then scattered into the tables in order.
+ * The caller should make sure that the chain won't wrap around in the middle.
+ */
+static void mf_skip_batch(struct lzma_mf *mf, const uint8_t *ip)
+{
+	const uint32_t pos = mf->cur + mf->offset;
+	mf_vec_t dualhash, hash_3, hash_value;
+	unsigned int i;
+
+	hash_value = (mf_vec_t) {
+		get_unaligned_le32(ip), get_unaligned_le32(ip + 1),
+		get_unaligned_le32(ip + 2), get_unaligned_le32(ip + 3)
+	};
+	hash_value = (hash_value * GOLDEN_RATIO_32) >> (32 - mf->hashbits);
+
+	for (i = 0; i < MF_SKIP_BATCH; ++i)
+		prefetchw(mf_hash_addr(mf, LZMA_HASH_4_BASE + hash_value[i]));
+
+	dualhash = (mf_vec_t) {
+		crc32_byte_hashtable[ip[0]], crc32_byte_hashtable[ip[1]],
+		crc32_byte_hashtable[ip[2]], crc32_byte_hashtable[ip[3]]
+	} ^ (mf_vec_t) { ip[1], ip[2], ip[3], ip[4] };
+	hash_3 = (dualhash ^ ((mf_vec_t) { ip[2], ip[3], ip[4], ip[5] } << 8)) &
+		(LZMA_HASH_3_SZ - 1);
+	dualhash &= LZMA_HASH_2_SZ - 1;
+
+	for (i = 0; i < MF_SKIP_BATCH; ++i) {
+		mf_hash_update(mf, dualhash[i], pos + i);
+		mf_hash_update(mf, LZMA_HASH_3_BASE + hash_3[i], pos + i);
+		mf_chain_insert(mf, mf->chaincur + i,
+				LZMA_HASH_4_BASE + hash_value[i], pos + i);
+	}
+	mf->cur += MF_SKIP_BATCH;
+	mf->chaincur += MF_SKIP_BATCH;
+}
+
+static unsigned int lzma_mf_do_ht4_find(struct lzma_mf *mf,
+					struct lzma_match *matches)
+{
+	const uint8_t *ip = mf->buffer + mf->cur;
+	const uint32_t pos = mf->cur + mf->offset;
+	const uint8_t *ilimit =
+		ip + mf->nice_len < mf->iend ? ip + mf->nice_len : mf->iend;
+	const uint32_t hash_value = mt_calc_hash_4(ip, mf->hashbits);
+	const uint32_t delta = mf_hash_update(mf, LZMA_HASH_4_BASE +
+					      hash_value, pos);
+	const uint8_t *matchend;
+
+	/* only the latest position with the same hash would be checked */
+	if (delta - 1 >= mf_delta_limit(mf) ||
+	    get_unaligned32(ip - delta) != get_unaligned32(ip))
+		return 0;
+
+	matchend = ez_memcmp(ip + 4, ip - delta + 4, ilimit);
+	matches[0] = (struct lzma_match) { .len = matchend - ip,
+					   .dist = delta };
+	return 1;
+}
+
 /* aka. lzma_mf_hc4_skip */
 void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 {
@@ -142,6 +329,13 @@ void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 	unsigned int unhashedskip = mf->unhashedskip;
 	unsigned int bytecount = 0;
 
+	/* nothing to insert, workers have found matches of all positions */
+	if (mf->mt) {
+		mf->cur += bytetotal;
+		mf->lookahead += bytetotal;
+		return;
+	}
+
 	if (unhashedskip) {
 		bytetotal += unhashedskip;
 		mf->cur -= unhashedskip;
@@ -164,20 +358,39 @@ void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 			break;
 		}
 
+		if (mf->type == LZMA_MF_HT4) {
+			mf_hash_update(mf, LZMA_HASH_4_BASE +
+				       mt_calc_hash_4(ip, hashbits),
+				       mf->cur + mf->offset);
+			mf_move(mf);
+			continue;
+		}
+
+		/* the last 3 bytes of the batch need 4-byte hashes as well */
+		if (bytetotal - bytecount >= MF_SKIP_BATCH &&
+		    mf->iend - ip >= MF_SKIP_BATCH + 3 &&
+		    mf->chaincur + MF_SKIP_BATCH < mf->chainsize) {
+			mf_skip_batch(mf, ip);
+			bytecount += MF_SKIP_BATCH - 1;
+			continue;
+		}
+
+		/* buckets of the next position are wanted in a moment */
+		if (bytecount + 1 < bytetotal && mf->iend - ip > 4)
+			mf_prefetch_hash(mf, ip + 1);
+
 		pos = mf->cur + mf->offset;
 
 		dualhash = mt_calc_dualhash(ip);
 		hash_2 = dualhash & (LZMA_HASH_2_SZ - 1);
-		mf->hash[hash_2] = pos;
+		mf_hash_update(mf, hash_2, pos);
 
 		hash_3 = mt_calc_hash_3(ip, dualhash);
-		mf->hash[LZMA_HASH_3_BASE + hash_3] = pos;
+		mf_hash_update(mf, LZMA_HASH_3_BASE + hash_3, pos);
 
 		hash_value = mt_calc_hash_4(ip, hashbits);
-
-		mf->chain[mf->chaincur] =
-			mf->hash[LZMA_HASH_4_BASE + hash_value];
-		mf->hash[LZMA_HASH_4_BASE + hash_value] = pos;
+		mf_chain_insert(mf, mf->chaincur,
+				LZMA_HASH_4_BASE + hash_value, pos);
 
 		mf_move(mf);
 	} while (++bytecount < bytetotal);
@@ -185,8 +398,8 @@ void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 	mf->lookahead += bytetotal;
 }
 
-static int lzma_mf_hc4_find(struct lzma_mf *mf,
-			    struct lzma_match *matches, bool finish)
+static int __lzma_mf_find(struct lzma_mf *mf,
+			  struct lzma_match *matches, bool finish)
 {
 	int ret;
 
@@ -200,7 +413,12 @@ static int lzma_mf_hc4_find(struct lzma_mf *mf,
 	}
 
 	if (!mf->eod) {
-		ret = lzma_mf_do_hc4_find(mf, matches);
+		if (mf->mt)
+			ret = lzma_mf_mt_find(mf, matches);
+		else if (mf->type == LZMA_MF_HT4)
+			ret = lzma_mf_do_ht4_find(mf, matches);
+		else
+			ret = lzma_mf_do_hc4_find(mf, matches);
 	} else {
 		ret = 0;
 		/* ++mf->unhashedskip; */
@@ -214,7 +432,7 @@ static int lzma_mf_hc4_find(struct lzma_mf *mf,
 int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 {
 	const uint8_t *ip = mf->buffer + mf->cur;
-	const uint8_t *iend = max((const uint8_t *)mf->iend,
+	const uint8_t *iend = min((const uint8_t *)mf->iend,
 				  ip + kMatchMaxLen);
 	unsigned int i;
 	int ret;
@@ -223,7 +441,7 @@ int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 	if (mf->unhashedskip)
 		lzma_mf_skip(mf, 0);
 
-	ret = lzma_mf_hc4_find(mf, matches, finish);
+	ret = __lzma_mf_find(mf, matches, finish);
 	if (ret <= 0)
 		return ret;
 
@@ -241,6 +459,38 @@ int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 	return ret;
 }
 
+/*
+ * Detect a run of kMatchMaxLen identical bytes at the current position, which
+ * is common for zero-filled or sparse data. If found, the run is consumed as
+ * a whole and only the last MF_RUN_INSERTS positions are inserted, so that
+ * the hash chains won't be flooded by the same 4-byte string. Returns the
+ * length of the distance-1 match the encoder should emit, or 0 if none.
+ */
+unsigned int lzma_mf_find_run(struct lzma_mf *mf)
+{
+	const uint8_t *ip = mf->buffer + mf->cur;
+	unsigned int skip;
+
+	if (!mf->cur || mf->unhashedskip ||
+	    mf->chainsize < kMatchMaxLen ||
+	    mf->iend - ip < kMatchMaxLen)
+		return 0;
+
+	if (get_unaligned32(ip) != get_unaligned32(ip - 1) ||
+	    ez_memcmp(ip + 4, ip + 3, ip + kMatchMaxLen) != ip + kMatchMaxLen)
+		return 0;
+
+	skip = kMatchMaxLen - MF_RUN_INSERTS;
+	mf->cur += skip;
+	mf->chaincur += skip;
+	if (mf->chaincur >= mf->chainsize)
+		mf->chaincur -= mf->chainsize;
+	mf->lookahead += skip;
+
+	lzma_mf_skip(mf, MF_RUN_INSERTS);
+	return kMatchMaxLen;
+}
+
 void lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in, unsigned int size)
 {
 	DBG_BUGON(mf->buffer + mf->cur > mf->iend);
@@ -253,15 +503,47 @@ void lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in, unsigned int size)
 	mf->iend += size;
 }
 
+static size_t mf_hash_bytes(unsigned int hashbits, bool compact)
+{
+	return (LZMA_HASH_4_BASE + (1U << hashbits)) *
+		(compact ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
+static size_t mf_chain_bytes(uint32_t chainsize, bool compact)
+{
+	return (size_t)chainsize *
+		(compact ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
+void lzma_mf_free(struct lzma_mf *mf)
+{
+	lzma_table_free(mf->allocator, mf->hash,
+			mf_hash_bytes(mf->hashbits, mf->compact), mf->hugepage);
+	mf->hash = NULL;
+	lzma_table_free(mf->allocator, mf->chain,
+			mf_chain_bytes(mf->chainsize, mf->compact), mf->hugepage);
+	mf->chain = NULL;
+	mf->hashbits = 0;
+}
+
 int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p)
 {
 	const uint32_t dictsize = p->dictsize;
+	uint32_t chainsize = p->chainsize;
 	unsigned int new_hashbits;
+	bool compact;
 
 	if (!dictsize)
 		return -EINVAL;
 
-	if (dictsize < UINT16_MAX) {
+	if (!chainsize || chainsize > dictsize)
+		chainsize = dictsize;
+
+	if (p->hashbits) {
+		if (p->hashbits < 10 || p->hashbits > 31)
+			return -EINVAL;
+		new_hashbits = p->hashbits;
+	} else if (dictsize < UINT16_MAX) {
 		new_hashbits = 16;
 	/* most significant set bit + 1 of distsize to derive hashbits */
 	} else {
@@ -272,25 +554,42 @@ int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p)
 			new_hashbits = 31;
 	}
 
+	/* 16-bit entries are enough to cover 64KiB dictionaries */
+	compact = (dictsize <= 65536);
+
 	if (new_hashbits != mf->hashbits ||
-	    mf->max_distance != dictsize - 1) {
-		if (mf->hash)
-			free(mf->hash);
-		if (mf->chain)
-			free(mf->chain);
-
-		mf->hashbits = 0;
-		mf->hash = calloc(LZMA_HASH_4_BASE + (1 << new_hashbits),
-				  sizeof(mf->hash[0]));
+	    mf->max_distance != dictsize - 1 || mf->type != p->type ||
+	    mf->chainsize != chainsize || mf->compact != compact ||
+	    mf->hugepage != p->hugepage || mf->allocator != p->allocator) {
+		const size_t hashbytes = mf_hash_bytes(new_hashbits, compact);
+
+		lzma_mf_free(mf);
+
+		ez_trace(lzma_mf_alloc, new_hashbits, dictsize);
+		/* HT4 only uses the hash_4 part, the rest is never touched */
+		mf->hash = lzma_table_alloc(p->allocator, hashbytes,
+					    true, p->hugepage);
 		if (!mf->hash)
 			return -ENOMEM;
 
-		mf->chain = malloc(sizeof(mf->chain[0]) * (dictsize - 1));
-		if (!mf->chain) {
-			free(mf->hash);
-			return -ENOMEM;
+		if (p->type != LZMA_MF_HT4) {
+			mf->chain = lzma_table_alloc(p->allocator,
+						     mf_chain_bytes(chainsize,
+								    compact),
+						     false, p->hugepage);
+			if (!mf->chain) {
+				lzma_table_free(p->allocator, mf->hash,
+						hashbytes, p->hugepage);
+				mf->hash = NULL;
+				return -ENOMEM;
+			}
 		}
 		mf->hashbits = new_hashbits;
+		mf->type = p->type;
+		mf->chainsize = chainsize;
+		mf->compact = compact;
+		mf->hugepage = p->hugepage;
+		mf->allocator = p->allocator;
 	}
 
 	mf->max_distance = dictsize - 1;
@@ -306,6 +605,80 @@ int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p)
 	mf->cur = 0;
 	mf->lookahead = 0;
 	mf->chaincur = 0;
+	mf->unhashedskip = 0;
+	mf->eod = false;
+	return 0;
+}
+
+size_t lzma_mf_tables_size(const struct lzma_mf *mf)
+{
+	size_t size = mf_hash_bytes(mf->hashbits, mf->compact);
+
+	if (mf->type != LZMA_MF_HT4)
+		size += mf_chain_bytes(mf->chainsize, mf->compact);
+	return size;
+}
+
+void lzma_mf_save(const struct lzma_mf *mf, struct lzma_mf_snapshot *s,
+		  void *tables)
+{
+	*s = (struct lzma_mf_snapshot) {
+		.offset = mf->offset,
+		.cur = mf->cur,
+		.lookahead = mf->lookahead,
+		.chaincur = mf->chaincur,
+		.unhashedskip = mf->unhashedskip,
+		.nice_len = mf->nice_len,
+		.depth = mf->depth,
+		.eod = mf->eod,
+	};
+
+	if (tables) {
+		const size_t hashbytes = mf_hash_bytes(mf->hashbits,
+						       mf->compact);
+
+		memcpy(tables, mf->hash, hashbytes);
+		if (mf->type != LZMA_MF_HT4)
+			memcpy((uint8_t *)tables + hashbytes, mf->chain,
+			       mf_chain_bytes(mf->chainsize, mf->compact));
+	}
+}
+
+/*
+ * `mf' should have been reset with the same properties and point to the same
+ * input. Without `tables', up to a dictionary of input before the position
+ * is inserted again instead, so later matches could differ a bit from the
+ * ones of the original match finder (e.g. after lzma_mf_find_run()).
+ */
+int lzma_mf_restore(struct lzma_mf *mf, const struct lzma_mf_snapshot *s,
+		    const void *tables)
+{
+	if (s->offset != mf->max_distance + 1 ||
+	    s->cur > mf->iend - mf->buffer || s->lookahead > s->cur ||
+	    s->unhashedskip > s->cur || s->chaincur >= mf->chainsize)
+		return -EINVAL;
+
+	if (tables) {
+		const size_t hashbytes = mf_hash_bytes(mf->hashbits,
+						       mf->compact);
+
+		memcpy(mf->hash, tables, hashbytes);
+		if (mf->type != LZMA_MF_HT4)
+			memcpy(mf->chain, (const uint8_t *)tables + hashbytes,
+			       mf_chain_bytes(mf->chainsize, mf->compact));
+		mf->cur = s->cur;
+		mf->chaincur = s->chaincur;
+		mf->unhashedskip = s->unhashedskip;
+	} else {
+		const uint32_t hashed = s->cur - s->unhashedskip;
+
+		mf->cur = hashed - min(hashed, mf->max_distance + 1);
+		lzma_mf_skip(mf, s->cur - mf->cur);
+	}
+	mf->lookahead = s->lookahead;
+	mf->nice_len = s->nice_len;
+	mf->depth = s->depth;
+	mf->eod = s->eod;
 	return 0;
 }
 
@@ -9,11 +9,33 @@
 
 #include <ez/util.h>
 #include "lzma_common.h"
+#include "alloc.h"
+
+enum lzma_mf_type {
+	LZMA_MF_HC4,	/* hash chain with 2-, 3- and 4-byte hashing */
+	LZMA_MF_HT4,	/* single-probe 4-byte hash table, no chain at all */
+};
 
 struct lzma_mf_properties {
+	enum lzma_mf_type type;
 	uint32_t dictsize;
 
 	uint32_t nice_len, depth;
+
+	/* log2 of the 4-byte hash table size, 0 to derive from dictsize */
+	uint32_t hashbits;
+
+	/*
+	 * the number of hash chain entries (0 for dictsize). If smaller than
+	 * dictsize, hash heads still reach the whole dictionary but chains
+	 * stop at chainsize bytes back, which bounds the memory footprint.
+	 */
+	uint32_t chainsize;
+
+	/* back large tables by huge pages if possible (see alloc.h) */
+	bool hugepage;
+	/* allocate tables by user callbacks instead, NULL for the default */
+	const struct lzma_allocator *allocator;
 };
 
 /*
@@ -47,10 +69,23 @@ struct lzma_mf {
 	uint32_t lookahead;
 
 	/* LZ matchfinder hash chain representation */
-	uint32_t *hash, *chain;
-
-	/* indicate the next byte in chain (0 ~ max_distance) */
-	uint32_t chaincur;
+	union {
+		uint32_t *hash;
+		uint16_t *hash16;	/* compact layout */
+	};
+	union {
+		uint32_t *chain;
+		uint16_t *chain16;	/* compact layout */
+	};
+	enum lzma_mf_type type;
+
+	/* use 16-bit hash and chain entries for dictsize <= 64KiB */
+	bool compact;
+	bool hugepage;
+	const struct lzma_allocator *allocator;
+
+	/* indicate the next byte in chain (0 ~ chainsize - 1) */
+	uint32_t chaincur, chainsize;
 	uint8_t hashbits;
 
 	/* maximum number of loops in the match finder */
@@ -62,12 +97,46 @@ struct lzma_mf {
 	uint32_t unhashedskip;
 
 	bool eod;
+
+	/* look up matches found by lzma_mf_mt_start() workers if not NULL */
+	struct lzma_mf_mt *mt;
 };
 
 int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish);
 void lzma_mf_skip(struct lzma_mf *mf, unsigned int n);
+unsigned int lzma_mf_find_run(struct lzma_mf *mf);
 void lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in, unsigned int size);
+void lzma_mf_free(struct lzma_mf *mf);
 int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p);
 
+/* the position and settings of a match finder, see lzma_mf_save() */
+struct lzma_mf_snapshot {
+	uint32_t offset, cur, lookahead;
+	uint32_t chaincur, unhashedskip;
+	uint32_t nice_len, depth;
+	bool eod;
+};
+
+/*
+ * Save the state of `mf', and also its hash and chain tables into `tables'
+ * (of lzma_mf_tables_size() bytes) if not NULL.
+ */
+size_t lzma_mf_tables_size(const struct lzma_mf *mf);
+void lzma_mf_save(const struct lzma_mf *mf, struct lzma_mf_snapshot *s,
+		  void *tables);
+int lzma_mf_restore(struct lzma_mf *mf, const struct lzma_mf_snapshot *s,
+		    const void *tables);
+
+/*
+ * Find matches of the whole input [buffer, iend) of `mf' by `nthreads'
+ * workers in segments of `segsize' bytes in advance. lzma_mf_find() then
+ * returns these in order, and lzma_mf_mt_stop() returns the first error of
+ * workers if any (some matches could be missing then, though still valid).
+ */
+int lzma_mf_mt_start(struct lzma_mf *mf, const struct lzma_mf_properties *p,
+		     unsigned int nthreads, uint32_t segsize);
+int lzma_mf_mt_stop(struct lzma_mf *mf);
+unsigned int lzma_mf_mt_find(struct lzma_mf *mf, struct lzma_match *matches);
+
 #endif
 
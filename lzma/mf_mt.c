@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * ez/lzma/mf_mt.c - parallel match finding within a single block
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * The block is split into segments, and each worker runs its own match
+ * finder over a segment after inserting the data just before it as history.
+ * Matches of all positions are kept in a ring of segment slots, and then
+ * lzma_mf_find() of the (sequential) encoder looks them up in order instead
+ * of searching, so one dictionary still covers the whole block.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include "mf.h"
+
+/* at most this many longest matches are kept for each position */
+#define MF_MT_MATCHES_MAX	4
+
+struct mf_mt_slot {
+	/* matches of position i are m[idx[i]] ~ m[idx[i + 1] - 1] */
+	uint32_t *idx;
+	struct lzma_match *m;
+	uint32_t capacity;
+
+	/* the segment to be held next, and if it has been found */
+	uint32_t seg;
+	bool ready;
+};
+
+struct lzma_mf_mt {
+	const uint8_t *buffer;
+	uint32_t len, segsize, nseg;
+	struct lzma_mf_properties props;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t next;		/* the next segment to be taken by workers */
+	bool abort;
+	int err;
+
+	/* the segment being looked up by the encoder */
+	struct mf_mt_slot *cur;
+	uint32_t curseg;
+
+	unsigned int nthreads, nslots;
+	pthread_t *threads;
+	struct mf_mt_slot slots[];
+};
+
+static int mf_mt_reserve(struct mf_mt_slot *s, uint32_t n)
+{
+	struct lzma_match *m;
+	uint32_t capacity;
+
+	if (n <= s->capacity)
+		return 0;
+	capacity = max(n, s->capacity + s->capacity / 2);
+	m = realloc(s->m, capacity * sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+	s->m = m;
+	s->capacity = capacity;
+	return 0;
+}
+
+/*
+ * Run a private match finder over segment `seg' to fill in slot `s'. The
+ * whole dictionary before the segment is inserted first so that no match
+ * is missed, but the match finder just goes on if `*mfpos' (where it
+ * stopped for the last segment) is within the dictionary already.
+ */
+static int mf_mt_find_segment(struct lzma_mf_mt *mt, struct lzma_mf *mf,
+			      uint32_t *mfpos, struct lzma_match *matches,
+			      uint32_t seg, struct mf_mt_slot *s)
+{
+	const uint32_t start = seg * mt->segsize;
+	const uint32_t end = min(start + mt->segsize, mt->len);
+	uint32_t i, n = 0;
+	int err;
+
+	if (*mfpos > start || start - *mfpos >= mt->props.dictsize) {
+		const uint32_t hs = start - min(start, mt->props.dictsize);
+
+		err = lzma_mf_reset(mf, &mt->props);
+		if (err)
+			return err;
+
+		/* the input is never written */
+		mf->buffer = (uint8_t *)mt->buffer + hs;
+		mf->iend = (uint8_t *)mt->buffer + mt->len;
+		*mfpos = hs;
+	}
+	lzma_mf_skip(mf, start - *mfpos);
+	*mfpos = end;
+
+	for (i = 0; i < end - start; ++i) {
+		int ret = lzma_mf_find(mf, matches, true);
+
+		s->idx[i] = n;
+		if (ret <= 0)
+			continue;
+
+		/* only the longest ones are useful to parsers */
+		if (ret > MF_MT_MATCHES_MAX) {
+			memmove(matches, matches + ret - MF_MT_MATCHES_MAX,
+				MF_MT_MATCHES_MAX * sizeof(*matches));
+			ret = MF_MT_MATCHES_MAX;
+		}
+		err = mf_mt_reserve(s, n + ret);
+		if (err)
+			return err;
+		memcpy(s->m + n, matches, ret * sizeof(*matches));
+		n += ret;
+	}
+	s->idx[i] = n;
+	return 0;
+}
+
+static void *mf_mt_worker(void *arg)
+{
+	struct lzma_mf_mt *const mt = arg;
+	struct lzma_match *matches;
+	struct lzma_mf mf = {0};
+	uint32_t mfpos = UINT32_MAX;
+	int err = 0;
+
+	matches = malloc((mt->props.depth + 3) * sizeof(*matches));
+	if (!matches)
+		err = -ENOMEM;
+
+	pthread_mutex_lock(&mt->lock);
+	while (!mt->abort && mt->next < mt->nseg) {
+		const uint32_t seg = mt->next++;
+		struct mf_mt_slot *const s = &mt->slots[seg % mt->nslots];
+
+		/* wait for the encoder to release the previous segment */
+		while (!mt->abort && s->seg != seg)
+			pthread_cond_wait(&mt->cond, &mt->lock);
+		if (mt->abort)
+			break;
+		pthread_mutex_unlock(&mt->lock);
+
+		if (!err)
+			err = mf_mt_find_segment(mt, &mf, &mfpos, matches,
+						 seg, s);
+
+		pthread_mutex_lock(&mt->lock);
+		/* mark it ready anyway, the encoder sees no matches then */
+		if (err) {
+			mt->err = err;
+			memset(s->idx, 0, (mt->segsize + 1) * sizeof(*s->idx));
+		}
+		s->ready = true;
+		pthread_cond_broadcast(&mt->cond);
+	}
+	pthread_mutex_unlock(&mt->lock);
+
+	lzma_mf_free(&mf);
+	free(matches);
+	return NULL;
+}
+
+/* release segments before `seg' in order, and wait for `seg' itself */
+static void mf_mt_next_segment(struct lzma_mf_mt *mt, uint32_t seg)
+{
+	struct mf_mt_slot *s;
+
+	pthread_mutex_lock(&mt->lock);
+	while (1) {
+		s = &mt->slots[mt->curseg % mt->nslots];
+		while (!s->ready || s->seg != mt->curseg)
+			pthread_cond_wait(&mt->cond, &mt->lock);
+		if (mt->curseg == seg)
+			break;
+
+		/* let workers reuse the slot for a later segment */
+		s->ready = false;
+		s->seg += mt->nslots;
+		pthread_cond_broadcast(&mt->cond);
+		++mt->curseg;
+	}
+	mt->cur = s;
+	pthread_mutex_unlock(&mt->lock);
+}
+
+unsigned int lzma_mf_mt_find(struct lzma_mf *mf, struct lzma_match *matches)
+{
+	struct lzma_mf_mt *const mt = mf->mt;
+	const uint32_t avail = mf->iend - mf->buffer - mf->cur;
+	const uint32_t seg = mf->cur / mt->segsize;
+	const struct lzma_match *m, *mend;
+	uint32_t i;
+	unsigned int n = 0;
+
+	/* positions only go forward */
+	if (!mt->cur || seg != mt->curseg)
+		mf_mt_next_segment(mt, seg);
+
+	i = mf->cur - mt->curseg * mt->segsize;
+	m = mt->cur->m + mt->cur->idx[i];
+	mend = mt->cur->m + mt->cur->idx[i + 1];
+
+	/* matches were found against the whole block, so trim to `iend' */
+	for (; m < mend; ++m) {
+		matches[n] = *m;
+		if (m->len >= avail) {
+			matches[n++].len = avail;
+			break;
+		}
+		++n;
+	}
+	return n;
+}
+
+int lzma_mf_mt_start(struct lzma_mf *mf, const struct lzma_mf_properties *p,
+		     unsigned int nthreads, uint32_t segsize)
+{
+	const uint32_t len = mf->iend - mf->buffer;
+	const unsigned int nslots = 2 * nthreads;
+	struct lzma_mf_mt *mt;
+	unsigned int i;
+	int err;
+
+	if (!nthreads || !segsize)
+		return -EINVAL;
+
+	mt = calloc(1, sizeof(*mt) + nslots * sizeof(mt->slots[0]));
+	if (!mt)
+		return -ENOMEM;
+	mt->buffer = mf->buffer;
+	mt->len = len;
+	mt->segsize = segsize;
+	mt->nseg = DIV_ROUND_UP(len, segsize);
+	mt->props = *p;
+	mt->nslots = nslots;
+	pthread_mutex_init(&mt->lock, NULL);
+	pthread_cond_init(&mt->cond, NULL);
+
+	err = -ENOMEM;
+	for (i = 0; i < nslots; ++i) {
+		mt->slots[i].seg = i;
+		mt->slots[i].idx = malloc((segsize + 1) *
+					  sizeof(*mt->slots[i].idx));
+		if (!mt->slots[i].idx)
+			goto err_out;
+	}
+
+	mt->threads = malloc(nthreads * sizeof(*mt->threads));
+	if (!mt->threads)
+		goto err_out;
+	for (i = 0; i < nthreads; ++i) {
+		err = -pthread_create(&mt->threads[i], NULL, mf_mt_worker, mt);
+		if (err)
+			break;
+	}
+	mt->nthreads = i;
+	mf->mt = mt;
+	if (!err)
+		return 0;
+	lzma_mf_mt_stop(mf);
+	return err;
+
+err_out:
+	mf->mt = mt;
+	lzma_mf_mt_stop(mf);
+	return err;
+}
+
+int lzma_mf_mt_stop(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *const mt = mf->mt;
+	unsigned int i;
+	int err;
+
+	if (!mt)
+		return 0;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->abort = true;
+	pthread_cond_broadcast(&mt->cond);
+	pthread_mutex_unlock(&mt->lock);
+
+	for (i = 0; i < mt->nthreads; ++i)
+		pthread_join(mt->threads[i], NULL);
+	free(mt->threads);
+
+	for (i = 0; i < mt->nslots; ++i) {
+		free(mt->slots[i].idx);
+		free(mt->slots[i].m);
+	}
+	pthread_cond_destroy(&mt->cond);
+	pthread_mutex_destroy(&mt->lock);
+	err = mt->err;
+	free(mt);
+	mf->mt = NULL;
+	return err;
+}
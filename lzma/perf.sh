@@ -0,0 +1,5 @@
+# L1 data cache misses of the encoder (-O2) on up to 64KiB of a file (the
+# limit of main()), e.g. `sh perf.sh file 5' before and after a layout change.
+# Needs perf and a hardware PMU, which virtual machines often don't expose.
+gcc -O2 -g -I ../include lzma_encoder.c mf.c alloc.c crc.c filter.c mf_mt.c dedup.c -lpthread -o perf.out &&
+perf stat -r 50 -e L1-dcache-loads,L1-dcache-load-misses ./perf.out /tmp/perf.xz "${1:-lzma_encoder.c}" "${2:-5}" > /dev/null
@@ -140,57 +140,69 @@ static inline bool rc_shift_low(struct lzma_rc_encoder *rc,
 static inline bool rc_encode(struct lzma_rc_encoder *rc,
 			     uint8_t **ppos, uint8_t *oend)
 {
-	DBG_BUGON(rc->count > RC_SYMBOLS_MAX);
+	/*
+	 * Keep the coder state in locals: output bytes are stored through
+	 * uint8_t pointers, which could alias `rc' and would otherwise force
+	 * reloading it for every symbol.
+	 */
+	const unsigned int count = rc->count;
+	unsigned int pos = rc->pos;
+	uint32_t range = rc->range;
+	uint64_t low = rc->low;
 
-	while (rc->pos < rc->count) {
-		/* Normalize */
-		if (rc->range < RC_TOP_VALUE) {
-			if (rc_shift_low(rc, ppos, oend))
-				return true;
-
-			rc->range <<= RC_SHIFT_BITS;
-		}
-
-		/* Encode a bit */
-		switch (rc->symbols[rc->pos]) {
-		case RC_BIT_0: {
-			probability prob = *rc->probs[rc->pos];
-
-			rc->range = rc_bound(rc->range, prob);
-			prob += (RC_BIT_MODEL_TOTAL - prob) >> RC_MOVE_BITS;
-			*rc->probs[rc->pos] = prob;
-			break;
-		}
+	DBG_BUGON(count > RC_SYMBOLS_MAX);
 
-		case RC_BIT_1: {
-			probability prob = *rc->probs[rc->pos];
-			const uint32_t bound = rc_bound(rc->range, prob);
+	for (; pos < count; ++pos) {
+		const unsigned int symbol = rc->symbols[pos];
 
-			rc->low += bound;
-			rc->range -= bound;
-			prob -= prob >> RC_MOVE_BITS;
-			*rc->probs[rc->pos] = prob;
-			break;
+		/* Normalize */
+		if (range < RC_TOP_VALUE) {
+			bool full;
+
+			rc->low = low;
+			full = rc_shift_low(rc, ppos, oend);
+			low = rc->low;
+			if (full)
+				goto out;
+			range <<= RC_SHIFT_BITS;
 		}
 
-		case RC_DIRECT_0:
-			rc->range >>= 1;
-			break;
-
-		case RC_DIRECT_1:
-			rc->range >>= 1;
-			rc->low += rc->range;
-			break;
+		/* Encode a bit */
+		if (likely(symbol <= RC_BIT_1)) {
+			probability *const p = rc->probs[pos];
+			probability prob = *p;
+			const uint32_t bound = rc_bound(range, prob);
+
+			if (symbol == RC_BIT_0) {
+				range = bound;
+				prob += (RC_BIT_MODEL_TOTAL - prob) >>
+					RC_MOVE_BITS;
+			} else {
+				low += bound;
+				range -= bound;
+				prob -= prob >> RC_MOVE_BITS;
+			}
+			*p = prob;
+		} else if (symbol == RC_DIRECT_0) {
+			range >>= 1;
+		} else if (symbol == RC_DIRECT_1) {
+			range >>= 1;
+			low += range;
+		} else {
+			DBG_BUGON(symbol != RC_FLUSH);
+			rc->range = range;
+			rc->low = low;
 
-		case RC_FLUSH:
 			/* Prevent further normalizations */
 			rc->range = UINT32_MAX;
 
 			/* Flush the last five bytes (see rc_flush()) */
 			do {
-				if (rc_shift_low(rc, ppos, oend))
+				if (rc_shift_low(rc, ppos, oend)) {
+					rc->pos = pos;
 					return true;
-			} while (++rc->pos < rc->count);
+				}
+			} while (++pos < count);
 
 			/*
 			 * Reset the range encoder so we are ready to continue
@@ -198,19 +210,20 @@ static inline bool rc_encode(struct lzma_rc_encoder *rc,
 			 */
 			rc_reset(rc);
 			return false;
-
-		default:
-			DBG_BUGON(1);
-			break;
 		}
-		++rc->pos;
 	}
 
+	rc->range = range;
+	rc->low = low;
 	rc->count = 0;
 	rc->pos = 0;
 	return false;
-}
 
+out:
+	rc->range = range;
+	rc->pos = pos;
+	return true;
+}
 
 static inline uint64_t rc_pending(const struct lzma_rc_encoder *rc)
 {
@@ -16,7 +16,8 @@ struct lzma_rc_ckpt {
 	uint8_t firstbyte;
 };
 
-void rc_write_checkpoint(struct lzma_rc_encoder *rc, struct lzma_rc_ckpt *cp)
+void rc_write_checkpoint(const struct lzma_rc_encoder *rc,
+			 struct lzma_rc_ckpt *cp)
 {
 	*cp = (struct lzma_rc_ckpt) { .low = rc->low,
 				      .extended_bytes = rc->extended_bytes,
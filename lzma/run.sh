@@ -1 +1 @@
-gcc -Wall -g -I ../include lzma_encoder.c mf.c
+gcc -Wall -g -I ../include lzma_encoder.c mf.c alloc.c crc.c filter.c mf_mt.c dedup.c -lpthread